@@ -1,7 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "proc.h"
+
 struct ata_identify {
 	u16 type;
 	u8 unused1[52];
@@ -15,15 +18,48 @@ struct ata_identify {
 	u8 unused5[304];
 } __attribute__ ((packed));
 
+struct ata_prd {
+	u32 address;
+	u16 size;
+	u16 flags;
+} __attribute__ ((packed));
+
+enum ata_operation {
+	ATA_READ, ATA_WRITE, ATA_FLUSH,
+};
+
+struct ata_request {
+	enum ata_operation operation;
+	u64 lba;
+	u64 count;
+	u8* buffer;
+	u8** vector;
+	u64 progress;
+	u64 chunk;
+	volatile bool done;
+	struct wait_queue waiters;
+	void (*callback)(struct ata_request*);
+	void* data;
+	struct ata_request* next;
+};
+
 struct ata_device {
 	u32 base;
 	u32 control;
+	u32 bus_master;
 	u8 slave;
 	u8 is_atapi;
 	struct ata_identify identify;
+	struct ata_prd* prdt;
+	u8* dma_buffer;
+	struct ata_request* queue_head;
+	struct ata_request* queue_tail;
 };
 
 void ata_init();
 struct ata_device* ata_get_device(int);
-void ata_read_sector(struct ata_device*, u64, void*);
-void ata_write_sector(struct ata_device*, u64, const void*);
+void ata_submit(struct ata_device*, struct ata_request*);
+void ata_wait(struct ata_request*);
+void ata_read_sectors(struct ata_device*, u64, u64, void*);
+void ata_write_sectors(struct ata_device*, u64, u64, const void*);
+void ata_flush(struct ata_device*);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <system.h>
+
+void block_init();
+u64 block_alloc(u64, u64*);
+void block_free(u64, u64);
+void block_stats(struct block_stats*);
+void block_sync();
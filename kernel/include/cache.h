@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+#include <system.h>
+
+void cache_init();
+void cache_read(u64, u64, void*);
+void cache_write(u64, u64, const void*);
+void cache_prefetch(u64, u64);
+void cache_sync();
+void cache_stats(struct disk_stats*);
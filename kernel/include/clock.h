@@ -2,4 +2,6 @@
 
 #include <stdint.h>
 
+extern u64 clock_ticks;
+
 void clock_init();
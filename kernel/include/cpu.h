@@ -15,7 +15,7 @@ static inline void out32(u16 port, u32 data) {
 }
 
 static inline void outs32(u16 port, u64 buffer, u32 count) {
-	asm volatile ("cld; rep; outsl" : : "D" (buffer), "d" (port), "c" (count));
+	asm volatile ("cld; rep; outsl" : "+S" (buffer), "+c" (count) : "d" (port) : "memory");
 }
 
 static inline u8 in8(u16 port) {
@@ -37,5 +37,31 @@ static inline u32 in32(u16 port) {
 }
 
 static inline void ins32(u16 port, u64 buffer, u32 count) {
-	asm volatile ("cld; rep; insl" : : "D" (buffer), "d" (port), "c" (count));
+	asm volatile ("cld; rep; insl" : "+D" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+static inline void cpuid(u32 leaf, u32* a, u32* b, u32* c, u32* d) {
+	asm volatile ("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d) : "a" (leaf), "c" (0));
+}
+
+static inline u64 rdmsr(u64 msr) {
+	u32 low, high;
+	asm volatile ("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+	return ((u64) high << 32) | low;
+}
+
+static inline void wrmsr(u64 msr, u64 data) {
+	u32 low = data & 0xFFFFFFFF;
+	u32 high = data >> 32;
+	asm volatile ("wrmsr" : : "c" (msr), "a" (low), "d" (high));
+}
+
+static inline u64 interrupts_disable() {
+	u64 flags;
+	asm volatile ("pushfq; popq %0; cli" : "=r" (flags) : : "memory");
+	return flags;
+}
+
+static inline void interrupts_restore(u64 flags) {
+	asm volatile ("pushq %0; popfq" : : "r" (flags) : "memory", "cc");
 }
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+void dentry_init();
+u64 dentry_lookup(const char*, u64*);
+void dentry_insert(const char*, u64, u64);
+void dentry_invalidate(u64, const char*);
@@ -6,6 +6,7 @@ struct isr_stack {
 	u64 cr0, cr2, cr3, cr4;
 	u64 rdi, rsi, rbp;
 	u64 rax, rbx, rcx, rdx;
+	u64 r8, r9, r10, r11, r12, r13, r14, r15;
 	u64 interrupt, error_code;
 	u64 rip, cs, flags, rsp, ss;
 };
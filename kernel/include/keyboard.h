@@ -1,4 +1,8 @@
 #pragma once
 
+#include <stdint.h>
+
 void keyboard_init();
 char keyboard_getchar();
+u64 keyboard_read(char*, u64);
+void keyboard_wait();
@@ -7,6 +7,8 @@
 #define PAGE_SIZE_2MIB 0x200000
 #define PAGE_SIZE_1GIB 0x40000000
 
+#define FRAME_MAGAZINE_SIZE 64
+
 #define MEM_AT_KERN(x) (0xFFFFFF8000000000 + (u64) (x))
 #define MEM_AT_PHYS(x) (0xFFFFFFC000000000 + (u64) (x))
 
@@ -20,7 +22,9 @@ struct page_table_entry {
 	u64 dirty : 1;
 	u64 huge : 1;
 	u64 global : 1;
-	u64 unused : 3;
+	u64 lazy : 1; // not present yet, backed by a zeroed frame on first access
+	u64 cow : 1; // read-only while the frame is shared after a fork
+	u64 unused : 1;
 	u64 frame : 40;
 	u64 unused1 : 11;
 	u64 no_execute : 1;
@@ -30,7 +34,17 @@ struct page_table {
 	struct page_table_entry entry[512];
 };
 
+// Free single frames kept by a processor
+struct frame_magazine {
+	u64 count;
+	u64 frames[FRAME_MAGAZINE_SIZE];
+};
+
 void memory_init();
+void memory_cpu_init();
+
+u64 memory_frame_alloc(u64);
+void memory_frame_free(u64, u64);
 
 void* memory_map(u64, u64, void*, u64);
 void memory_unmap(u64, void*, u64);
@@ -38,7 +52,14 @@ void memory_unmap(u64, void*, u64);
 void* memory_share(u64, u64, void*, u64);
 void* memory_alloc(u64, void*, u64);
 void memory_free(u64, void*, u64);
+bool memory_fault(void*);
+void memory_prefault(u64, void*, u64);
+void memory_prezero();
 
 u64 memory_pm_get();
 u64 memory_pm_new();
+u64 memory_pm_clone(u64);
 void memory_pm_free();
+
+u64 memory_pcid_alloc();
+void memory_pcid_free(u64);
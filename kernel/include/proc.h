@@ -3,31 +3,69 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "smp.h"
+
+// Timer ticks a program may run before it is preempted
+#define PROC_QUANTUM 10
+#define PROC_HASH 64
+#define PROC_STACK_PAGES 2
+#define PROC_IDLE_PAGES 2
+#define PROC_PCID_FLUSHED (1ull << 63)
+#define PROC_NO_CPU ((u64) -1)
+
+#define current_proc (cpu_get()->proc)
+
 enum proc_status {
-	PROC_RUNNING, PROC_READY, PROC_DONE,
+	PROC_RUNNING, PROC_READY, PROC_BLOCKED, PROC_DONE,
+};
+
+// Processes blocked until something happens, which wakes all of them
+struct wait_queue {
+	struct proc* head;
 };
 
 struct proc {
 	u64 rax, rbx, rcx, rdx;
 	u64 rsi, rdi, rsp, rbp;
 	u64 cr3;
+	u64 r12, r13, r14, r15;
+	u64 pcid; // bit 63 is set once the PCID has been flushed
 
-	u64 pid, waitpid;
+	u64 pid;
 	u64 ret;
 	void* stack;
-	char cwd[256];
+	char cwd[256]; // of the whole process, only the group's is used
+
+	// Threads share the page map of the process they were created in, which
+	// stays until the last of them is done
+	struct proc* group;
+	u64 threads; // not yet done, in the group
 
 	enum proc_status status;
-	struct proc* prev;
-	struct proc* next;
+	struct wait_queue waiters;
+	struct proc* wait_next;
+	struct proc* hash_next;
+	struct proc* next; // in a ready queue
+	struct cpu* cpu; // while running, until switched away from
+	u64 last_cpu;
 };
 
+extern u64 proc_quantum;
+
 void proc_init();
+void proc_init_cpu(struct cpu*);
 
 u64 proc_exec(const char*, const char**);
-void proc_yield();
+u64 proc_fork();
+bool proc_yield();
+void proc_tick(bool);
+void proc_idle();
+void proc_sleep(struct wait_queue*);
+void proc_wake(struct wait_queue*);
 void proc_exit(u64);
 u64 proc_wait(u64);
+u64 proc_thread_create(void*, u64, u64);
+u64 proc_thread_join(u64);
 
 char* proc_getcwd(char*);
 bool proc_chdir(const char*);
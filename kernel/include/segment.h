@@ -43,4 +43,7 @@ struct tss {
 	u32 _reserved3;
 } __attribute__ ((packed));
 
+struct cpu;
+
 void segment_init();
+void segment_init_cpu(struct cpu*, u64, u64);
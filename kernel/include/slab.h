@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+struct slab_cache;
+
+struct slab_cache* slab_create(const char*, u64, void (*)(void*));
+void* slab_alloc(struct slab_cache*);
+void slab_free(struct slab_cache*, void*);
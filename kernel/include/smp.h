@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "memory.h"
+#include "segment.h"
+
+#define SMP_MAX_CPUS 16 // also in smp.s
+#define SMP_STACK_PAGES 4
+// Where the other processors start in real mode, in the low memory the boot
+// loader is done with
+#define SMP_TRAMPOLINE 0x8000
+
+#define SMP_VECTOR_TIMER 0x30
+#define SMP_VECTOR_SPURIOUS 0x3F
+
+struct proc;
+
+struct cpu {
+	struct cpu* self; // at %gs:0
+	u64 id;
+	struct proc* proc;
+	struct proc* idle; // runs when nothing else can
+	struct proc* ready_head;
+	struct proc* ready_tail;
+	u64 slice;
+	u64 tlb_generation;
+	volatile bool tlb_flush;
+	u64 apic_id;
+	union gdt_entry gdt[5];
+	struct tss tss;
+	struct frame_magazine magazine;
+};
+
+extern struct cpu cpus[SMP_MAX_CPUS];
+extern u64 cpu_count;
+
+static inline struct cpu* cpu_get() {
+	struct cpu* cpu;
+	asm volatile ("movq %%gs:0, %0" : "=r" (cpu));
+	return cpu;
+}
+
+void smp_init();
+void smp_eoi();
+bool smp_nmi();
+void smp_tlb_invalidate();
+void smp_tlb_shootdown(u64);
+
+void kernel_lock();
+void kernel_unlock();
+u64 kernel_depth();
+u64 kernel_release();
+void kernel_reacquire(u64);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Taken with interrupts disabled by anything an interrupt handler takes too
+struct spinlock {
+	volatile u32 locked;
+};
+
+static inline bool spin_trylock(struct spinlock* lock) {
+	return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_lock(struct spinlock* lock) {
+	while (!spin_trylock(lock))
+		while (lock->locked)
+			asm volatile ("pause");
+}
+
+static inline void spin_unlock(struct spinlock* lock) {
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
@@ -6,4 +6,5 @@ void tty_init();
 void tty_putchar(char);
 void tty_puts(const char*);
 void tty_printf(const char*, ...);
+u64 tty_output(const char*, u64);
 u64 tty_flush();
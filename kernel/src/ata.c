@@ -2,10 +2,16 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "cpu.h"
+#include "isr.h"
+#include "memory.h"
 #include "panic.h"
 #include "pci.h"
+#include "proc.h"
+#include "slab.h"
 
 #define ATA_SR_BSY		0x80
 #define ATA_SR_DRDY		0x40
@@ -48,6 +54,23 @@
 #define ATA_REG_ALTSTATUS	0x0C
 #define ATA_REG_DEVADDRESS	0x0D
 
+#define ATA_BM_COMMAND		0x00
+#define ATA_BM_STATUS		0x02
+#define ATA_BM_PRDT			0x04
+
+#define ATA_BM_CMD_START	0x01
+#define ATA_BM_CMD_READ		0x08
+
+#define ATA_BM_SR_ACTIVE	0x01
+#define ATA_BM_SR_ERR		0x02
+#define ATA_BM_SR_IRQ		0x04
+
+#define ATA_PRD_EOT			0x8000
+
+#define ATA_DMA_PAGES		16
+#define ATA_DMA_SECTORS		(ATA_DMA_PAGES * PAGE_SIZE / 512)
+#define ATA_MAX_SECTORS		65536
+
 struct ata_device ata_devices[4] = {
 	{ .base = 0x1F0, .control = 0x3F6, .slave = 0 },
 	{ .base = 0x1F0, .control = 0x3F6, .slave = 1 },
@@ -55,6 +78,8 @@ struct ata_device ata_devices[4] = {
 	{ .base = 0x170, .control = 0x376, .slave = 1 },
 };
 
+static struct ata_device* ata_active[2] = { NULL };
+
 struct ata_device* ata_get_device(int index) {
 	return index < 4 ? &ata_devices[index] : NULL;
 }
@@ -99,48 +124,272 @@ static void ata_device_detect(struct ata_device* device) {
 		*k-- = '\0';
 }
 
-void ata_init() {
-	u32 device = pci_scan(0x0101);
-	if (device == (u32) -1)
-		panic("no IDE controller");
-	for (int i = 0; i < 4; i++)
-		ata_device_detect(&ata_devices[i]);
+static void ata_dma_init(struct ata_device* device, u32 bus_master) {
+	if (device->is_atapi || !(device->identify.capabilities & 0x100))
+		return;
+	u64 prdt = memory_frame_alloc(1);
+	u64 buffer = memory_frame_alloc(ATA_DMA_PAGES);
+	if (prdt + PAGE_SIZE > 0x100000000 || buffer + ATA_DMA_PAGES * PAGE_SIZE > 0x100000000) {
+		memory_frame_free(prdt / PAGE_SIZE, 1);
+		memory_frame_free(buffer / PAGE_SIZE, ATA_DMA_PAGES);
+		return;
+	}
+	device->bus_master = bus_master;
+	device->prdt = (struct ata_prd*) MEM_AT_PHYS(prdt);
+	device->dma_buffer = (u8*) MEM_AT_PHYS(buffer);
+	for (int i = 0; i < ATA_DMA_PAGES; i++) {
+		device->prdt[i].address = buffer + i * PAGE_SIZE;
+		device->prdt[i].size = PAGE_SIZE;
+		device->prdt[i].flags = 0;
+	}
 }
 
 static void ata_pio_out_lba(struct ata_device* device, u64 lba, u16 count) {
-	out8(device->control, (1 << 7) | (1 << 1));
-	out8(device->base + ATA_REG_SECCOUNT1 - 6, 0);
+	out8(device->control, (1 << 7));
+	out8(device->base + ATA_REG_SECCOUNT1 - 6, (count >> 8) & 0xFF);
 	out8(device->base + ATA_REG_LBA3 - 6, (lba >> 24) & 0xFF);
 	out8(device->base + ATA_REG_LBA4 - 6, (lba >> 32) & 0xFF);
 	out8(device->base + ATA_REG_LBA5 - 6, (lba >> 40) & 0xFF);
-	out8(device->control, (1 << 1));
+	out8(device->control, 0);
 	out8(device->base + ATA_REG_SECCOUNT0, count & 0xFF);
 	out8(device->base + ATA_REG_LBA0, (lba >>  0) & 0xFF);
 	out8(device->base + ATA_REG_LBA1, (lba >>  8) & 0xFF);
 	out8(device->base + ATA_REG_LBA2, (lba >> 16) & 0xFF);
 }
 
-void ata_read_sector(struct ata_device* device, u64 lba, void* buffer) {
-	if (!(device->identify.capabilities & 0x200))
-		panic("Device does not support LBA\n");
-	while (in8(device->base + ATA_REG_STATUS) & ATA_SR_BSY);
-	out8(device->base + ATA_REG_HDDEVSEL, 0xE0 | (device->slave << 4));
-	ata_pio_out_lba(device, lba, 1);
-	out8(device->base + ATA_REG_COMMAND, ATA_CMD_READ_PIO_EXT);
+static u8 ata_check(struct ata_device* device, u8 status) {
+	if (status & (ATA_SR_ERR | ATA_SR_DF))
+		panic("ata: device error (status %x, error %x)", status, in8(device->base + ATA_REG_ERROR));
+	return status;
+}
+
+static u8 ata_poll(struct ata_device* device) {
 	ata_io_wait(device);
-	while (in8(device->base + ATA_REG_STATUS) & ATA_SR_BSY);
-	ins32(device->base + ATA_REG_DATA, (u64) buffer, 128);
+	u8 status;
+	while ((status = in8(device->base + ATA_REG_STATUS)) & ATA_SR_BSY);
+	return ata_check(device, status);
 }
 
-void ata_write_sector(struct ata_device* device, u64 lba, const void* buffer) {
+static void ata_command(struct ata_device* device, u8 command, u64 lba, u64 count) {
 	if (!(device->identify.capabilities & 0x200))
 		panic("Device does not support LBA\n");
 	while (in8(device->base + ATA_REG_STATUS) & ATA_SR_BSY);
 	out8(device->base + ATA_REG_HDDEVSEL, 0xE0 | (device->slave << 4));
-	ata_pio_out_lba(device, lba, 1);
-	out8(device->base + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO_EXT);
-	ata_io_wait(device);
-	while (in8(device->base + ATA_REG_STATUS) & ATA_SR_BSY);
-	outs32(device->base + ATA_REG_DATA, (u64) buffer, 128);
-	out8(device->base + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH_EXT);
+	ata_pio_out_lba(device, lba, count == ATA_MAX_SECTORS ? 0 : count);
+	out8(device->base + ATA_REG_COMMAND, command);
+}
+
+static int ata_channel(struct ata_device* device) {
+	return device->base == ata_devices[0].base ? 0 : 1;
+}
+
+static u8* ata_sector(struct ata_request* request, u64 index) {
+	if (request->vector != NULL)
+		return request->vector[index];
+	return request->buffer + index * 512;
+}
+
+static void ata_start(struct ata_device* device) {
+	struct ata_request* request = device->queue_head;
+	ata_active[ata_channel(device)] = device;
+
+	if (request->operation == ATA_FLUSH) {
+		while (in8(device->base + ATA_REG_STATUS) & ATA_SR_BSY);
+		out8(device->base + ATA_REG_HDDEVSEL, 0xE0 | (device->slave << 4));
+		out8(device->base + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH_EXT);
+		return;
+	}
+
+	bool read = request->operation == ATA_READ;
+	u64 remaining = request->count - request->progress;
+	if (device->dma_buffer != NULL) {
+		request->chunk = remaining < ATA_DMA_SECTORS ? remaining : ATA_DMA_SECTORS;
+		u64 pages = (request->chunk * 512 + PAGE_SIZE - 1) / PAGE_SIZE;
+		for (u64 i = 0; i < ATA_DMA_PAGES; i++) {
+			device->prdt[i].size = PAGE_SIZE;
+			device->prdt[i].flags = 0;
+		}
+		device->prdt[pages - 1].size = request->chunk * 512 - (pages - 1) * PAGE_SIZE;
+		device->prdt[pages - 1].flags = ATA_PRD_EOT;
+		if (!read)
+			for (u64 i = 0; i < request->chunk; i++)
+				memcpy(device->dma_buffer + i * 512, ata_sector(request, request->progress + i), 512);
+
+		out32(device->bus_master + ATA_BM_PRDT, (u64) device->prdt - MEM_AT_PHYS(0));
+		out8(device->bus_master + ATA_BM_COMMAND, read ? ATA_BM_CMD_READ : 0);
+		out8(device->bus_master + ATA_BM_STATUS, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+		ata_command(device, read ? ATA_CMD_READ_DMA_EXT : ATA_CMD_WRITE_DMA_EXT, request->lba + request->progress, request->chunk);
+		out8(device->bus_master + ATA_BM_COMMAND, (read ? ATA_BM_CMD_READ : 0) | ATA_BM_CMD_START);
+	} else {
+		request->chunk = remaining < ATA_MAX_SECTORS ? remaining : ATA_MAX_SECTORS;
+		ata_command(device, read ? ATA_CMD_READ_PIO_EXT : ATA_CMD_WRITE_PIO_EXT, request->lba + request->progress, request->chunk);
+		if (!read) {
+			ata_poll(device);
+			outs32(device->base + ATA_REG_DATA, (u64) ata_sector(request, request->progress), 128);
+		}
+	}
+}
+
+static void ata_complete(struct ata_device* device) {
+	struct ata_request* request = device->queue_head;
+	device->queue_head = request->next;
+	if (device->queue_head == NULL)
+		device->queue_tail = NULL;
+	request->done = true;
+	proc_wake(&request->waiters);
+	if (request->callback != NULL)
+		request->callback(request);
+
+	int channel = ata_channel(device);
+	struct ata_device* sibling = &ata_devices[channel * 2 + !device->slave];
+	ata_active[channel] = NULL;
+	if (sibling->queue_head != NULL)
+		ata_start(sibling);
+	else if (device->queue_head != NULL)
+		ata_start(device);
+}
+
+static void ata_isr(int channel) {
+	struct ata_device* device = ata_active[channel];
+	if (device == NULL) {
+		in8(ata_devices[channel * 2].base + ATA_REG_STATUS);
+		return;
+	}
+	struct ata_request* request = device->queue_head;
+
+	if (request->operation == ATA_FLUSH) {
+		ata_check(device, in8(device->base + ATA_REG_STATUS));
+		ata_complete(device);
+		return;
+	}
+
+	if (device->dma_buffer != NULL) {
+		u8 bm_status = in8(device->bus_master + ATA_BM_STATUS);
+		if (!(bm_status & ATA_BM_SR_IRQ))
+			return;
+		out8(device->bus_master + ATA_BM_COMMAND, 0);
+		out8(device->bus_master + ATA_BM_STATUS, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+		ata_check(device, in8(device->base + ATA_REG_STATUS));
+		if (bm_status & ATA_BM_SR_ERR)
+			panic("ata: bus master error (status %x)", bm_status);
+		if (request->operation == ATA_READ)
+			for (u64 i = 0; i < request->chunk; i++)
+				memcpy(ata_sector(request, request->progress + i), device->dma_buffer + i * 512, 512);
+		request->progress += request->chunk;
+		request->chunk = 0;
+	} else if (request->operation == ATA_READ) {
+		ata_check(device, in8(device->base + ATA_REG_STATUS));
+		ins32(device->base + ATA_REG_DATA, (u64) ata_sector(request, request->progress), 128);
+		request->progress++;
+		request->chunk--;
+	} else {
+		ata_check(device, in8(device->base + ATA_REG_STATUS));
+		request->progress++;
+		if (--request->chunk > 0)
+			outs32(device->base + ATA_REG_DATA, (u64) ata_sector(request, request->progress), 128);
+	}
+
+	if (request->chunk > 0)
+		return;
+	if (request->progress < request->count)
+		ata_start(device);
+	else
+		ata_complete(device);
+}
+
+void ata_submit(struct ata_device* device, struct ata_request* request) {
+	request->progress = 0;
+	request->chunk = 0;
+	request->done = false;
+	request->waiters.head = NULL;
+	request->next = NULL;
+
+	u64 flags = interrupts_disable();
+	if (device->queue_tail != NULL)
+		device->queue_tail->next = request;
+	else
+		device->queue_head = request;
+	device->queue_tail = request;
+	if (ata_active[ata_channel(device)] == NULL)
+		ata_start(device);
+	interrupts_restore(flags);
+}
+
+void ata_wait(struct ata_request* request) {
+	u64 flags = interrupts_disable();
+	while (!request->done)
+		proc_sleep(&request->waiters);
+	interrupts_restore(flags);
+}
+
+static struct slab_cache* ata_request_cache;
+
+static void ata_request_init(void* object) {
+	struct ata_request* request = object;
+	request->vector = NULL;
+	request->callback = NULL;
+	request->data = NULL;
+}
+
+static void ata_transfer(struct ata_device* device, enum ata_operation operation, u64 lba, u64 count, void* buffer) {
+	if (count == 0)
+		return;
+	// Requests are completed from interrupt context, possibly under another
+	// process' page map, so they may only reference kernel memory.
+	bool bounce = operation != ATA_FLUSH && (u64) buffer < MEM_AT_KERN(0);
+	struct ata_request* request = slab_alloc(ata_request_cache);
+	request->operation = operation;
+	request->lba = lba;
+	request->count = count;
+	request->buffer = bounce ? malloc(count * 512) : buffer;
+	if (bounce && operation == ATA_WRITE)
+		memcpy(request->buffer, buffer, count * 512);
+	ata_submit(device, request);
+	ata_wait(request);
+	if (bounce && operation == ATA_READ)
+		memcpy(buffer, request->buffer, count * 512);
+	if (bounce)
+		free(request->buffer);
+	slab_free(ata_request_cache, request);
+}
+
+void ata_read_sectors(struct ata_device* device, u64 lba, u64 count, void* buffer) {
+	ata_transfer(device, ATA_READ, lba, count, buffer);
+}
+
+void ata_write_sectors(struct ata_device* device, u64 lba, u64 count, const void* buffer) {
+	ata_transfer(device, ATA_WRITE, lba, count, (void*) buffer);
+}
+
+void ata_flush(struct ata_device* device) {
+	ata_transfer(device, ATA_FLUSH, 0, 1, NULL);
+}
+
+static void ata_isr_primary() {
+	ata_isr(0);
+}
+
+static void ata_isr_secondary() {
+	ata_isr(1);
+}
+
+void ata_init() {
+	u32 device = pci_scan(0x0101);
+	if (device == (u32) -1)
+		panic("no IDE controller");
+	ata_request_cache = slab_create("ata_request", sizeof(struct ata_request), ata_request_init);
+	for (int i = 0; i < 4; i++)
+		ata_device_detect(&ata_devices[i]);
+
+	isr_set(0x2E, ata_isr_primary);
+	isr_set(0x2F, ata_isr_secondary);
+	out8(ata_devices[0].control, 0);
+	out8(ata_devices[2].control, 0);
+
+	u32 bar4 = pci_read(device, PCI_BAR4, 4);
+	if (!(bar4 & 1) || !(bar4 & 0xFFFC))
+		return;
+	pci_write(device, PCI_COMMAND, 2, pci_read(device, PCI_COMMAND, 2) | (1 << 2));
+	for (int i = 0; i < 4; i++)
+		ata_dma_init(&ata_devices[i], (bar4 & 0xFFFC) + (i / 2) * 8);
 }
@@ -0,0 +1,144 @@
+#include "block.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdfile.h>
+#include <stdlib.h>
+
+#include "cache.h"
+
+static struct {
+	u8* bitmap;
+	bool* dirty;
+	u64 total_blocks;
+	u64 bitmap_blocks;
+	u64 bitmap_offset;
+	u64 free_blocks;
+	u64 cursor;
+} block;
+
+static bool block_used(u64 index) {
+	return block.bitmap[index / 8] & (0x80 >> (index % 8));
+}
+
+static void block_mark(u64 index, bool used) {
+	if (used)
+		block.bitmap[index / 8] |= 0x80 >> (index % 8);
+	else
+		block.bitmap[index / 8] &= ~(0x80 >> (index % 8));
+	block.dirty[index / 4096] = true;
+}
+
+void block_init() {
+	std_file_t super;
+	cache_read(0, 1, &super);
+	block.total_blocks = super.total_blocks;
+	block.bitmap_blocks = super.bitmap_blocks;
+	block.bitmap_offset = super.bitmap_offset;
+
+	block.bitmap = malloc(block.bitmap_blocks * 512);
+	block.dirty = calloc(block.bitmap_blocks * sizeof(bool));
+	cache_read(block.bitmap_offset, block.bitmap_blocks, block.bitmap);
+	for (u64 index = 0; index < block.total_blocks; index++)
+		if (!block_used(index))
+			block.free_blocks++;
+}
+
+static u64 block_find(u64 start, u64 end) {
+	u64* words = (u64*) block.bitmap;
+	for (u64 index = start; index < end;) {
+		// Skip over fully used words at once
+		if (index % 64 == 0 && index + 64 <= end && words[index / 64] == ~0ull) {
+			index += 64;
+			continue;
+		}
+		if (!block_used(index))
+			return index;
+		index++;
+	}
+	return 0;
+}
+
+static u64 block_search(u64 start, u64 end, u64 count, u64* best_run) {
+	u64 best = 0;
+	for (u64 index = start; (index = block_find(index, end)) != 0;) {
+		u64 run = 1;
+		while (run < count && index + run < end && !block_used(index + run))
+			run++;
+		if (run > *best_run) {
+			best = index;
+			*best_run = run;
+		}
+		if (run == count)
+			break;
+		index += run;
+	}
+	return best;
+}
+
+u64 block_alloc(u64 count, u64* allocated) {
+	// Next fit: look for a free run of the full size starting where the last
+	// allocation ended, and settle for the longest run otherwise
+	u64 run = 0;
+	u64 first = block_search(block.cursor, block.total_blocks, count, &run);
+	if (run < count) {
+		u64 wrapped = block_search(0, block.cursor, count, &run);
+		if (wrapped != 0)
+			first = wrapped;
+	}
+	if (first == 0) {
+		if (allocated != NULL)
+			*allocated = 0;
+		return 0;
+	}
+	for (u64 i = 0; i < run; i++)
+		block_mark(first + i, true);
+	block.free_blocks -= run;
+	block.cursor = first + run;
+	if (allocated != NULL)
+		*allocated = run;
+	return first;
+}
+
+void block_free(u64 index, u64 count) {
+	for (u64 i = 0; i < count; i++) {
+		if (index + i >= block.total_blocks || !block_used(index + i))
+			continue;
+		block_mark(index + i, false);
+		block.free_blocks++;
+	}
+	// Hand back an unused tail of the last allocation to the next one
+	if (index + count == block.cursor)
+		block.cursor = index;
+}
+
+void block_stats(struct block_stats* stats) {
+	stats->total = block.total_blocks;
+	stats->free = block.free_blocks;
+	stats->extents = 0;
+	stats->largest = 0;
+	for (u64 index = 0; (index = block_find(index, block.total_blocks)) != 0;) {
+		u64 run = 1;
+		while (index + run < block.total_blocks && !block_used(index + run))
+			run++;
+		stats->extents++;
+		if (run > stats->largest)
+			stats->largest = run;
+		index += run;
+	}
+}
+
+void block_sync() {
+	// Write back the changed parts of the bitmap
+	for (u64 i = 0; i < block.bitmap_blocks;) {
+		if (!block.dirty[i]) {
+			i++;
+			continue;
+		}
+		u64 run = 0;
+		while (i + run < block.bitmap_blocks && block.dirty[i + run])
+			block.dirty[i + run++] = false;
+		cache_write(block.bitmap_offset + i, run, block.bitmap + i * 512);
+		i += run;
+	}
+}
@@ -0,0 +1,298 @@
+#include "cache.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ata.h"
+#include "boot.h"
+#include "cpu.h"
+#include "memory.h"
+#include "proc.h"
+
+#define CACHE_MIN_BLOCKS 1024
+#define CACHE_MAX_BLOCKS 65536
+#define CACHE_RUN 64
+#define CACHE_PREFETCH_SLOTS 4
+
+struct cache_entry {
+	u64 block;
+	u8* data;
+	bool valid;
+	bool dirty;
+	bool listed;
+	volatile bool busy;
+	struct cache_entry* hash_next;
+	struct cache_entry* dirty_next;
+	struct cache_entry* prev;
+	struct cache_entry* next;
+};
+
+struct cache_prefetch {
+	struct ata_request request;
+	u8* vector[CACHE_RUN];
+	struct cache_entry* entries[CACHE_RUN];
+	bool used;
+};
+
+static struct {
+	struct ata_device* device;
+	struct cache_entry* entries;
+	struct cache_entry** hash;
+	u64 hash_mask;
+	struct cache_entry* head;
+	struct cache_entry* tail;
+	struct cache_entry* dirty; // everything made dirty since the last sync
+	bool unflushed;
+	u8* staging;
+	bool locked;
+	struct wait_queue lock_waiters;
+	struct wait_queue busy_waiters;
+	struct cache_prefetch prefetch[CACHE_PREFETCH_SLOTS];
+	struct disk_stats stats;
+} cache;
+
+void cache_init() {
+	// Use about 1/64th of the memory for the cache
+	u64 count = BOOT_INFO->total_memory / 64 / 512;
+	if (count < CACHE_MIN_BLOCKS) count = CACHE_MIN_BLOCKS;
+	if (count > CACHE_MAX_BLOCKS) count = CACHE_MAX_BLOCKS;
+	u64 buckets = 1;
+	while (buckets < count)
+		buckets <<= 1;
+
+	cache.device = ata_get_device(0);
+	cache.entries = calloc(count * sizeof(struct cache_entry));
+	cache.hash = calloc(buckets * sizeof(struct cache_entry*));
+	cache.hash_mask = buckets - 1;
+	cache.staging = memory_alloc(memory_pm_get(), NULL, CACHE_RUN * 512 / PAGE_SIZE);
+	cache.stats.blocks = count;
+
+	u8* data = memory_alloc(memory_pm_get(), NULL, (count * 512 + PAGE_SIZE - 1) / PAGE_SIZE);
+	for (u64 i = 0; i < count; i++) {
+		struct cache_entry* entry = &cache.entries[i];
+		entry->data = data + i * 512;
+		entry->prev = i > 0 ? &cache.entries[i - 1] : NULL;
+		entry->next = i < count - 1 ? &cache.entries[i + 1] : NULL;
+	}
+	cache.head = &cache.entries[0];
+	cache.tail = &cache.entries[count - 1];
+}
+
+static void cache_lock() {
+	u64 flags = interrupts_disable();
+	while (cache.locked)
+		proc_sleep(&cache.lock_waiters);
+	cache.locked = true;
+	interrupts_restore(flags);
+}
+
+static void cache_unlock() {
+	cache.locked = false;
+	proc_wake(&cache.lock_waiters);
+}
+
+static struct cache_entry* cache_lookup(u64 block) {
+	struct cache_entry* entry = cache.hash[block & cache.hash_mask];
+	while (entry != NULL && entry->block != block)
+		entry = entry->hash_next;
+	return entry;
+}
+
+static void cache_hash(struct cache_entry* entry) {
+	struct cache_entry** bucket = &cache.hash[entry->block & cache.hash_mask];
+	entry->hash_next = *bucket;
+	*bucket = entry;
+}
+
+static void cache_unhash(struct cache_entry* entry) {
+	struct cache_entry** bucket = &cache.hash[entry->block & cache.hash_mask];
+	while (*bucket != entry)
+		bucket = &(*bucket)->hash_next;
+	*bucket = entry->hash_next;
+}
+
+static void cache_touch(struct cache_entry* entry) {
+	if (cache.head == entry)
+		return;
+	entry->prev->next = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+	entry->prev = NULL;
+	entry->next = cache.head;
+	cache.head->prev = entry;
+	cache.head = entry;
+}
+
+static void cache_writeback(struct cache_entry* entry) {
+	// Write back the whole run of dirty blocks around this one
+	u64 first = entry->block;
+	while (first > 0 && entry->block - first < CACHE_RUN - 1) {
+		struct cache_entry* prev = cache_lookup(first - 1);
+		if (prev == NULL || !prev->dirty)
+			break;
+		first--;
+	}
+	u64 count = 0;
+	while (count < CACHE_RUN) {
+		struct cache_entry* curr = cache_lookup(first + count);
+		if (curr == NULL || !curr->dirty)
+			break;
+		memcpy(cache.staging + count * 512, curr->data, 512);
+		curr->dirty = false;
+		count++;
+	}
+	ata_write_sectors(cache.device, first, count, cache.staging);
+	cache.unflushed = true;
+	cache.stats.writebacks += count;
+	cache.stats.dirty -= count;
+}
+
+static void cache_wait(struct cache_entry* entry) {
+	u64 flags = interrupts_disable();
+	while (entry->busy)
+		proc_sleep(&cache.busy_waiters);
+	interrupts_restore(flags);
+}
+
+static struct cache_entry* cache_get(u64 block) {
+	struct cache_entry* entry = cache_lookup(block);
+	if (entry != NULL) {
+		cache_wait(entry);
+	} else {
+		// Blocks still being prefetched can't be evicted
+		entry = cache.tail;
+		while (entry->busy)
+			entry = entry->prev;
+		if (entry->dirty)
+			cache_writeback(entry);
+		if (entry->valid) {
+			cache_unhash(entry);
+			cache.stats.evictions++;
+		}
+		entry->block = block;
+		entry->valid = false;
+		cache_hash(entry);
+	}
+	cache_touch(entry);
+	return entry;
+}
+
+void cache_read(u64 block, u64 count, void* buffer) {
+	u8* dest = buffer;
+	cache_lock();
+	for (u64 i = 0; i < count;) {
+		struct cache_entry* entry = cache_lookup(block + i);
+		if (entry != NULL) {
+			cache_wait(entry);
+			memcpy(dest + i * 512, entry->data, 512);
+			cache_touch(entry);
+			cache.stats.hits++;
+			i++;
+			continue;
+		}
+
+		u64 run = 1;
+		while (i + run < count && cache_lookup(block + i + run) == NULL)
+			run++;
+		ata_read_sectors(cache.device, block + i, run, dest + i * 512);
+		cache.stats.misses += run;
+		for (; run > 0; run--, i++) {
+			entry = cache_get(block + i);
+			memcpy(entry->data, dest + i * 512, 512);
+			entry->valid = true;
+		}
+	}
+	cache_unlock();
+}
+
+void cache_write(u64 block, u64 count, const void* buffer) {
+	const u8* src = buffer;
+	cache_lock();
+	for (u64 i = 0; i < count; i++) {
+		struct cache_entry* entry = cache_get(block + i);
+		memcpy(entry->data, src + i * 512, 512);
+		entry->valid = true;
+		if (!entry->dirty)
+			cache.stats.dirty++;
+		entry->dirty = true;
+		if (!entry->listed) {
+			entry->listed = true;
+			entry->dirty_next = cache.dirty;
+			cache.dirty = entry;
+		}
+	}
+	cache_unlock();
+}
+
+static void cache_prefetch_done(struct ata_request* request) {
+	struct cache_prefetch* prefetch = request->data;
+	for (u64 i = 0; i < request->count; i++) {
+		prefetch->entries[i]->valid = true;
+		prefetch->entries[i]->busy = false;
+	}
+	prefetch->used = false;
+	proc_wake(&cache.busy_waiters);
+}
+
+void cache_prefetch(u64 block, u64 count) {
+	cache_lock();
+	for (u64 i = 0; i < count;) {
+		if (cache_lookup(block + i) != NULL) {
+			i++;
+			continue;
+		}
+
+		struct cache_prefetch* prefetch = NULL;
+		for (int slot = 0; slot < CACHE_PREFETCH_SLOTS && prefetch == NULL; slot++)
+			if (!cache.prefetch[slot].used)
+				prefetch = &cache.prefetch[slot];
+		if (prefetch == NULL)
+			break;
+		prefetch->used = true;
+
+		u64 run = 0;
+		for (; i < count && run < CACHE_RUN && cache_lookup(block + i) == NULL; i++, run++) {
+			struct cache_entry* entry = cache_get(block + i);
+			entry->busy = true;
+			prefetch->entries[run] = entry;
+			prefetch->vector[run] = entry->data;
+		}
+		prefetch->request.operation = ATA_READ;
+		prefetch->request.lba = block + i - run;
+		prefetch->request.count = run;
+		prefetch->request.buffer = NULL;
+		prefetch->request.vector = prefetch->vector;
+		prefetch->request.callback = cache_prefetch_done;
+		prefetch->request.data = prefetch;
+		cache.stats.prefetches += run;
+		ata_submit(cache.device, &prefetch->request);
+	}
+	cache_unlock();
+}
+
+// Called at every commit point, so it only visits blocks written since the
+// last one, and leaves the disk alone if there were none. Entries on the list
+// may have been written back or reused since, which is checked here
+void cache_sync() {
+	cache_lock();
+	while (cache.dirty != NULL) {
+		struct cache_entry* entry = cache.dirty;
+		cache.dirty = entry->dirty_next;
+		entry->listed = false;
+		if (entry->dirty)
+			cache_writeback(entry);
+	}
+	if (cache.unflushed) {
+		ata_flush(cache.device);
+		cache.unflushed = false;
+	}
+	cache_unlock();
+}
+
+void cache_stats(struct disk_stats* stats) {
+	memcpy(stats, &cache.stats, sizeof(*stats));
+}
@@ -4,8 +4,17 @@
 
 #include "cpu.h"
 #include "isr.h"
+#include "memory.h"
+#include "proc.h"
 
-void clock_isr() {}
+u64 clock_ticks;
+
+void clock_isr(struct isr_stack s) {
+	clock_ticks++;
+	// Only programs are preempted, kernel code may be holding on to shared
+	// state and gives the processor up on its own
+	proc_tick(s.rip < MEM_AT_KERN(0));
+}
 
 void clock_init() {
 	isr_set(0x20, clock_isr);
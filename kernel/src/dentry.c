@@ -0,0 +1,129 @@
+#include "dentry.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <system.h>
+
+#define DENTRY_COUNT 512
+#define DENTRY_PATH_LENGTH 256
+
+struct dentry {
+	char path[DENTRY_PATH_LENGTH];
+	u64 hash;
+	u64 name;
+	u64 parent;
+	u64 block;
+	struct dentry* hash_next;
+	struct dentry* prev;
+	struct dentry* next;
+};
+
+// Resolved absolute paths, including ones known not to exist
+static struct {
+	struct dentry* entries;
+	struct dentry* hash[DENTRY_COUNT];
+	struct dentry* head;
+	struct dentry* tail;
+} dentry;
+
+static u64 dentry_hash_path(const char* path) {
+	u64 hash = 0xCBF29CE484222325;
+	for (; *path; path++)
+		hash = (hash ^ (u8) *path) * 0x100000001B3;
+	return hash;
+}
+
+void dentry_init() {
+	dentry.entries = calloc(DENTRY_COUNT * sizeof(struct dentry));
+	for (u64 i = 0; i < DENTRY_COUNT; i++) {
+		struct dentry* entry = &dentry.entries[i];
+		entry->prev = i > 0 ? &dentry.entries[i - 1] : NULL;
+		entry->next = i < DENTRY_COUNT - 1 ? &dentry.entries[i + 1] : NULL;
+	}
+	dentry.head = &dentry.entries[0];
+	dentry.tail = &dentry.entries[DENTRY_COUNT - 1];
+}
+
+static struct dentry* dentry_find(const char* path, u64 hash) {
+	struct dentry* entry = dentry.hash[hash % DENTRY_COUNT];
+	while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+		entry = entry->hash_next;
+	return entry;
+}
+
+static void dentry_unhash(struct dentry* entry) {
+	struct dentry** bucket = &dentry.hash[entry->hash % DENTRY_COUNT];
+	while (*bucket != entry)
+		bucket = &(*bucket)->hash_next;
+	*bucket = entry->hash_next;
+	entry->path[0] = 0;
+}
+
+static void dentry_touch(struct dentry* entry) {
+	if (dentry.head == entry)
+		return;
+	entry->prev->next = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		dentry.tail = entry->prev;
+	entry->prev = NULL;
+	entry->next = dentry.head;
+	dentry.head->prev = entry;
+	dentry.head = entry;
+}
+
+// Finds the longest cached prefix of the path that ends at a component,
+// and stores its length. Returns 0 if there is none
+u64 dentry_lookup(const char* path, u64* length) {
+	char prefix[DENTRY_PATH_LENGTH];
+	u64 end = strlen(path);
+	*length = 0;
+	while (end > 0) {
+		if (end < DENTRY_PATH_LENGTH) {
+			memcpy(prefix, path, end);
+			prefix[end] = 0;
+			struct dentry* entry = dentry_find(prefix, dentry_hash_path(prefix));
+			if (entry != NULL) {
+				dentry_touch(entry);
+				*length = end;
+				return entry->block;
+			}
+		}
+		do end--; while (end > 0 && path[end] != '/');
+	}
+	return 0;
+}
+
+void dentry_insert(const char* path, u64 parent, u64 block) {
+	if (strlen(path) >= DENTRY_PATH_LENGTH)
+		return;
+	u64 hash = dentry_hash_path(path);
+	struct dentry* entry = dentry_find(path, hash);
+	if (entry == NULL) {
+		entry = dentry.tail;
+		if (entry->path[0] != 0)
+			dentry_unhash(entry);
+		strcpy(entry->path, path);
+		entry->hash = hash;
+		entry->name = strrchr(path, '/') + 1 - path;
+		entry->hash_next = dentry.hash[hash % DENTRY_COUNT];
+		dentry.hash[hash % DENTRY_COUNT] = entry;
+	}
+	entry->parent = parent;
+	entry->block = block;
+	dentry_touch(entry);
+}
+
+// Drops the entry for a name in a directory, or with no name everything
+// cached under the directory
+void dentry_invalidate(u64 parent, const char* name) {
+	for (u64 i = 0; i < DENTRY_COUNT; i++) {
+		struct dentry* entry = &dentry.entries[i];
+		if (entry->path[0] != 0 && entry->parent == parent
+				&& (name == NULL || !strcmp(entry->path + entry->name, name)))
+			dentry_unhash(entry);
+	}
+}
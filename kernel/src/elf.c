@@ -28,11 +28,13 @@ void* elf_load(u64 page_map, const char* path) {
 		void* vaddr = (void*) (p->vaddr & ~((u64) 0xFFF));
 		u64 pages = ((p->vaddr & 0xFFF) + p->memsz + PAGE_SIZE - 1) / PAGE_SIZE;
 		memory_alloc(page_map, vaddr, pages);
-		void* share = memory_share(memory_pm_get(), page_map, vaddr, pages);
-		void* dest = share + (p->vaddr & 0xFFF);
-		memset(dest + p->filesz, 0, p->memsz - p->filesz);
-		memcpy(dest, buffer + p->offset, p->filesz);
-		memory_unmap(memory_pm_get(), share, pages);
+		// Lazy pages start out zeroed, so only the file contents are copied
+		u64 file_pages = ((p->vaddr & 0xFFF) + p->filesz + PAGE_SIZE - 1) / PAGE_SIZE;
+		if (file_pages == 0)
+			continue;
+		void* share = memory_share(memory_pm_get(), page_map, vaddr, file_pages);
+		memcpy(share + (p->vaddr & 0xFFF), buffer + p->offset, p->filesz);
+		memory_unmap(memory_pm_get(), share, file_pages);
 	}
 
 	free(buffer);
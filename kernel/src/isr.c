@@ -9,6 +9,7 @@
 #include "segment.h"
 #include "panic.h"
 #include "proc.h"
+#include "smp.h"
 
 static void* isr[256] = { NULL };
 
@@ -25,8 +26,10 @@ void isr_init() {
 	out8(0x21, 0x00);
 	out8(0xA1, 0x00);
 
-	// Mask all interrupts except keyboard
-	out8(0x21, 0xFF & ~3);
+	// Mask all interrupts except timer and keyboard, which were always on,
+	// and the cascade and IDE lines behind it. The idle hlt wakes on the timer
+	out8(0x21, 0xFF & ~3 & ~(1 << 2));
+	out8(0xA1, 0xFF & ~(3 << 6));
 
 	// Enable interrupts
 	asm volatile ("sti");
@@ -36,19 +39,30 @@ void isr_set(u8 interrupt, void* handler) {
 	isr[interrupt] = handler;
 }
 
-void isr_handler(struct isr_stack s) {
-	if (s.interrupt >= 32) {
-		if (s.interrupt >= 40)
-			out8(0xA0, 0x20);
-		out8(0x20, 0x20);
-		void* handler = isr[s.interrupt];
-		if (handler) ((void (*)(struct isr_stack)) handler)(s);
-		else printf("Unhandled interrupt 0x%x\n", s.interrupt);
-	} else {
-		extern struct proc* current_proc;
+void isr_handler(struct isr_stack* s) {
+	// Nothing was delivered, so there is nothing to acknowledge
+	if (s->interrupt == SMP_VECTOR_SPURIOUS)
+		return;
+	// Shootdowns don't wait for the kernel lock, their sender holds it
+	if (s->interrupt == 2 && smp_nmi())
+		return;
+	kernel_lock();
+	if (s->interrupt >= 32) {
+		if (s->interrupt >= 48) {
+			smp_eoi();
+		} else {
+			if (s->interrupt >= 40)
+				out8(0xA0, 0x20);
+			out8(0x20, 0x20);
+		}
+		void* handler = isr[s->interrupt];
+		if (handler) ((void (*)(struct isr_stack)) handler)(*s);
+		else printf("Unhandled interrupt 0x%x\n", s->interrupt);
+	} else if (s->interrupt != 14 || !memory_fault((void*) s->cr2)) {
 		if (current_proc->pid == 0)
-			panic_isr(s);
+			panic_isr(*s);
 		else
-			panic_isr_user(s);
+			panic_isr_user(*s);
 	}
+	kernel_unlock();
 }
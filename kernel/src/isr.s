@@ -64,8 +64,32 @@ isr_vector:
 	ISR_NOERR $45
 	ISR_NOERR $46
 	ISR_NOERR $47
+	ISR_NOERR $48
+	ISR_NOERR $49
+	ISR_NOERR $50
+	ISR_NOERR $51
+	ISR_NOERR $52
+	ISR_NOERR $53
+	ISR_NOERR $54
+	ISR_NOERR $55
+	ISR_NOERR $56
+	ISR_NOERR $57
+	ISR_NOERR $58
+	ISR_NOERR $59
+	ISR_NOERR $60
+	ISR_NOERR $61
+	ISR_NOERR $62
+	ISR_NOERR $63
 
 isr_common:
+	push %r15
+	push %r14
+	push %r13
+	push %r12
+	push %r11
+	push %r10
+	push %r9
+	push %r8
 	push %rdx
 	push %rcx
 	push %rbx
@@ -84,7 +108,14 @@ isr_common:
 	mov %cr0, %rax
 	push %rax
 
+	# Keep the SSE state of the interrupted code
+	mov %rsp, %rdi
+	mov %rsp, %rbx
+	sub $512, %rsp
+	fxsave (%rsp)
 	call isr_handler
+	fxrstor (%rsp)
+	mov %rbx, %rsp
 
 	pop %rax # cr0
 	pop %rax # cr2
@@ -99,6 +130,14 @@ isr_common:
 	pop %rbx
 	pop %rcx
 	pop %rdx
+	pop %r8
+	pop %r9
+	pop %r10
+	pop %r11
+	pop %r12
+	pop %r13
+	pop %r14
+	pop %r15
 
 	addq $16, %rsp
 	sti
@@ -5,12 +5,16 @@
 
 #include "ata.h"
 #include "bga.h"
+#include "block.h"
+#include "cache.h"
 #include "clock.h"
+#include "dentry.h"
 #include "keyboard.h"
 #include "memory.h"
 #include "isr.h"
 #include "proc.h"
 #include "segment.h"
+#include "smp.h"
 #include "syscall.h"
 #include "tty.h"
 
@@ -19,18 +23,23 @@ void _libc_init_heap();
 void kernel_main() {
 	syscall_init();
 	memory_init();
+	segment_init();
+	kernel_lock();
 
 	_libc_init_heap();
 	stdin = stream_open(NULL);
 	stdout = stream_open(NULL);
 
-	segment_init();
 	tty_init();
 	isr_init();
 	clock_init();
 	keyboard_init();
-	ata_init();
 	proc_init();
+	smp_init();
+	ata_init();
+	cache_init();
+	block_init();
+	dentry_init();
 	bga_init();
 
 	bga_clear(0xAA0000);
@@ -39,8 +48,8 @@ void kernel_main() {
 	proc_exec("/bin/init", NULL);
 	while (1) {
 		if (!tty_flush()) {
-			asm ("hlt");
-			yield();
+			memory_prezero();
+			proc_idle();
 		}
 	}
 }
@@ -8,6 +8,8 @@
 #include "cpu.h"
 #include "isr.h"
 #include "memory.h"
+#include "proc.h"
+#include "smp.h"
 
 #define MOD_LCTRL 0
 #define MOD_RCTRL 1
@@ -43,6 +45,7 @@ static const char keymap_hi[] = {
 };
 
 static bool mod[MOD_COUNT] = { false };
+static struct wait_queue waiters;
 
 static void send_key(int key) {
 	if (key < KEY_ESC) {
@@ -105,6 +108,26 @@ void keyboard_isr() {
 			stream_write(stdin, &c, 1);
 			break;
 	}
+	proc_wake(&waiters);
+}
+
+// Blocks until there is input to read
+void keyboard_wait() {
+	u64 flags = interrupts_disable();
+	while (stdin->length == 0)
+		proc_sleep(&waiters);
+	interrupts_restore(flags);
+}
+
+// Takes input the ISR queued, with it kept out meanwhile. Programs on any
+// processor read, so this holds the kernel lock too
+u64 keyboard_read(char* buffer, u64 length) {
+	kernel_lock();
+	u64 flags = interrupts_disable();
+	u64 read = stream_read(stdin, buffer, length);
+	interrupts_restore(flags);
+	kernel_unlock();
+	return read;
 }
 
 void keyboard_init() {
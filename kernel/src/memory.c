@@ -3,70 +3,235 @@
 #include <stddef.h>
 
 #include "boot.h"
+#include "cpu.h"
 #include "panic.h"
+#include "smp.h"
 #include "string.h"
 #include "tty.h"
 
+#define FRAME_ORDERS 19
+#define FRAME_MAGAZINE_ORDER 5
+#define FRAME_MAGAZINE_BATCH (1 << FRAME_MAGAZINE_ORDER)
+#define MEMORY_ZERO_POOL 64
+#define MEMORY_PCIDS 4096
+
+struct frame_node {
+	struct frame_node* next;
+	struct frame_node* prev;
+};
+
 u64 kernel_page_map;
 u64 total_pages;
 u8* frame_bitmap = (u8*) MEM_AT_PHYS(0x100000);
 
+// Buddy allocator: free lists of 2^order frame blocks, linked through the
+// free frames themselves, and the order (plus one) of every free block head
+static struct frame_node* frame_free[FRAME_ORDERS];
+static u8* frame_order;
+
+// Extra references to frames shared copy-on-write, a frame is only freed once
+// nobody else holds it
+static u16* frame_refs;
+
+// Zeroed frames for lazy pages, refilled while the system is idle
+static u64 zero_frames[MEMORY_ZERO_POOL];
+static u64 zero_count;
+
+// Address space tags, 0 is the kernel's and used when PCIDs aren't supported
+static bool pcid_enabled;
+static u64 pcid_used[MEMORY_PCIDS / 64];
+
+static void memory_frame_init();
+static void memory_space_init();
+static void memory_tlb_init();
+
 void memory_init() {
 	total_pages = (BOOT_INFO->total_memory + PAGE_SIZE - 1) / PAGE_SIZE;
+	memory_frame_init();
 	kernel_page_map = memory_pm_get();
 	memory_unmap(kernel_page_map, 0, 1);
+	memory_space_init();
+	memory_tlb_init();
+	memory_cpu_init();
+}
+
+// Paging setup every processor does for itself
+void memory_cpu_init() {
+	// Have read-only pages fault in ring 0 too, for copy-on-write
+	asm volatile ("movq %%cr0, %%rax; orq $0x10000, %%rax; movq %%rax, %%cr0" ::: "rax");
+
+	// Toggling PGE flushes everything, global entries included
+	u64 cr4;
+	asm volatile ("movq %%cr4, %0" : "=r" (cr4));
+	asm volatile ("movq %0, %%cr4" :: "r" (cr4 & ~(1ull << 7)) : "memory");
+	if (pcid_enabled)
+		cr4 |= 1ull << 17;
+	asm volatile ("movq %0, %%cr4" :: "r" (cr4 | (1ull << 7)) : "memory");
 }
 
 /*
  * Physical memory
  */
 
-bool memory_frame_check(u64 frame, u64 length) {
-	if (frame + length >= total_pages)
-		return false;
-	while (length--) {
-		if (frame_bitmap[frame / 8] & (1 << (7 - (frame % 8))))
-			return true;
-		frame++;
+static bool memory_frame_used(u64 frame) {
+	return frame_bitmap[frame / 8] & (1 << (7 - (frame % 8)));
+}
+
+static u64 frame_of(struct frame_node* node) {
+	return ((u64) node - MEM_AT_PHYS(0)) / PAGE_SIZE;
+}
+
+static void frame_push(u64 frame, u64 order) {
+	struct frame_node* node = (void*) MEM_AT_PHYS(frame * PAGE_SIZE);
+	node->prev = NULL;
+	node->next = frame_free[order];
+	if (node->next != NULL)
+		node->next->prev = node;
+	frame_free[order] = node;
+	frame_order[frame] = order + 1;
+}
+
+static void frame_unlink(u64 frame, u64 order) {
+	struct frame_node* node = (void*) MEM_AT_PHYS(frame * PAGE_SIZE);
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		frame_free[order] = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	frame_order[frame] = 0;
+}
+
+static void frame_release(u64 frame, u64 order) {
+	// Merge with the buddy for as long as it is free too
+	for (; order < FRAME_ORDERS - 1; order++) {
+		u64 buddy = frame ^ (1ull << order);
+		if (buddy + (1ull << order) > total_pages || frame_order[buddy] != order + 1)
+			break;
+		frame_unlink(buddy, order);
+		frame &= ~(1ull << order);
+	}
+	frame_push(frame, order);
+}
+
+// Returns 0 (always in use by the firmware) if no block is large enough
+static u64 frame_take(u64 order) {
+	u64 curr = order;
+	while (curr < FRAME_ORDERS && frame_free[curr] == NULL)
+		curr++;
+	if (curr >= FRAME_ORDERS)
+		return 0;
+
+	u64 frame = frame_of(frame_free[curr]);
+	frame_unlink(frame, curr);
+	while (curr > order) {
+		curr--;
+		frame_push(frame + (1ull << curr), curr);
 	}
-	return false;
+	return frame;
 }
 
-void memory_frame_set(u64 frame, u64 length) {
+static void frame_give(u64 frame, u64 length) {
+	// Split the range into the largest aligned blocks that fit
 	while (length > 0) {
-		if (frame % 8 == 0 && length >= 8) {
-			frame_bitmap[frame / 8] = 0xFF;
-			frame += 8;
-			length -= 8;
-		} else {
-			frame_bitmap[frame / 8] |= (1 << (7 - (frame % 8)));
-			frame++;
-			length--;
-		}
+		u64 order = 0;
+		while (order < FRAME_ORDERS - 1 && (frame & ((2ull << order) - 1)) == 0
+				&& (2ull << order) <= length)
+			order++;
+		frame_release(frame, order);
+		frame += 1ull << order;
+		length -= 1ull << order;
 	}
 }
 
+static void frame_refill(struct frame_magazine* magazine) {
+	u64 frame = frame_take(FRAME_MAGAZINE_ORDER);
+	if (frame != 0) {
+		for (u64 i = FRAME_MAGAZINE_BATCH; i > 0; i--)
+			magazine->frames[magazine->count++] = frame + i - 1;
+		return;
+	}
+	while (magazine->count < FRAME_MAGAZINE_BATCH && (frame = frame_take(0)) != 0)
+		magazine->frames[magazine->count++] = frame;
+}
+
+static void frame_drain(struct frame_magazine* magazine) {
+	for (u64 i = 0; i < FRAME_MAGAZINE_BATCH; i++)
+		frame_release(magazine->frames[i], 0);
+	magazine->count -= FRAME_MAGAZINE_BATCH;
+	memmove(magazine->frames, magazine->frames + FRAME_MAGAZINE_BATCH, magazine->count * sizeof(u64));
+}
+
+// Single frames are handed out from and freed into a magazine per processor in
+// front of the buddy lists, which is refilled and drained in batches. Under the
+// kernel lock this mostly keeps recently freed frames warm in the cache of the
+// processor that reuses them; it is also where the lock would split first
+static struct frame_magazine* frame_magazine_get() {
+	// The boot processor has no GS base until segment_init
+	return cpus[0].self != NULL ? &cpu_get()->magazine : &cpus[0].magazine;
+}
+
 u64 memory_frame_alloc(u64 length) {
-	for (u64 i = 0; i < total_pages; i++) {
-		if (memory_frame_check(i, length))
-			continue;
-		memory_frame_set(i, length);
-		return i * PAGE_SIZE;
+	if (length == 1) {
+		struct frame_magazine* magazine = frame_magazine_get();
+		if (magazine->count == 0)
+			frame_refill(magazine);
+		if (magazine->count == 0)
+			panic("memory_frame_alloc: out of memory");
+		return magazine->frames[--magazine->count] * PAGE_SIZE;
 	}
-	panic("memory_frame_alloc: out of memory");
+
+	u64 order = 0;
+	while ((1ull << order) < length)
+		order++;
+	u64 frame = frame_take(order);
+	if (frame == 0)
+		panic("memory_frame_alloc: out of memory");
+	// Give back the tail of a request that isn't a power of two
+	if (length < (1ull << order))
+		frame_give(frame + length, (1ull << order) - length);
+	return frame * PAGE_SIZE;
 }
 
 void memory_frame_free(u64 frame, u64 length) {
-	while (length > 0) {
-		if (frame % 8 == 0 && length >= 8) {
-			frame_bitmap[frame / 8] = 0;
-			frame += 8;
-			length -= 8;
-		} else {
-			frame_bitmap[frame / 8] &= ~(1 << (7 - (frame % 8)));
+	if (length == 1) {
+		if (frame_refs[frame] > 0) {
+			frame_refs[frame]--;
+			return;
+		}
+		struct frame_magazine* magazine = frame_magazine_get();
+		if (magazine->count == FRAME_MAGAZINE_SIZE)
+			frame_drain(magazine);
+		magazine->frames[magazine->count++] = frame;
+		return;
+	}
+	frame_give(frame, length);
+}
+
+static void memory_frame_init() {
+	// Take room for the reference and order tables from the boot bitmap,
+	// which then seeds the free lists and isn't used anymore
+	u64 pages = (total_pages * (sizeof(u16) + sizeof(u8)) + PAGE_SIZE - 1) / PAGE_SIZE;
+	u64 table = 0;
+	for (u64 run = 0; run < pages; table++)
+		run = memory_frame_used(table) ? 0 : run + 1;
+	table -= pages;
+	frame_refs = (u16*) MEM_AT_PHYS(table * PAGE_SIZE);
+	memset(frame_refs, 0, total_pages * sizeof(u16));
+	frame_order = (u8*) (frame_refs + total_pages);
+	memset(frame_order, 0, total_pages);
+
+	for (u64 frame = 0; frame < total_pages;) {
+		if (memory_frame_used(frame) || (frame >= table && frame < table + pages)) {
 			frame++;
-			length--;
+			continue;
 		}
+		u64 length = 1;
+		while (frame + length < total_pages && !memory_frame_used(frame + length)
+				&& frame + length != table)
+			length++;
+		frame_give(frame, length);
+		frame += length;
 	}
 }
 
@@ -85,169 +250,572 @@ static inline void invlpg(void* addr) {
     asm volatile ("invlpg (%0)" : : "b" (addr) : "memory");
 }
 
-static bool memory_virt_used(u64 page_map, void* vaddr, u64 size) {
-	struct page_table* p4 = (void*) MEM_AT_PHYS(page_map);
-	for (; size--; vaddr += PAGE_SIZE) {
+/*
+ * Virtual address space
+ */
+
+#define MEMORY_SPACES 64
+
+// Free ranges of an address space, in a treap ordered by start address that
+// tracks the largest range of every subtree
+struct memory_range {
+	u64 start;
+	u64 end;
+	u64 largest;
+	u64 priority;
+	struct memory_range* left;
+	struct memory_range* right;
+};
+
+struct memory_space {
+	u64 page_map;
+	u64 start;
+	u64 end;
+	struct memory_range* free;
+	struct memory_space* next;
+};
+
+static struct memory_space kernel_space;
+static struct memory_space* spaces[MEMORY_SPACES];
+static void* range_pool;
+static void* space_pool;
+
+// Objects for the address space bookkeeping come straight from frames, so
+// that it never has to go through the heap, which itself maps memory
+static void* memory_object(void** pool, u64 size) {
+	if (*pool == NULL) {
+		u8* page = (u8*) MEM_AT_PHYS(memory_frame_alloc(1));
+		for (u64 offset = 0; offset + size <= PAGE_SIZE; offset += size) {
+			*(void**) (page + offset) = *pool;
+			*pool = page + offset;
+		}
+	}
+	void* object = *pool;
+	*pool = *(void**) object;
+	return object;
+}
+
+static void memory_object_free(void** pool, void* object) {
+	*(void**) object = *pool;
+	*pool = object;
+}
+
+static struct memory_space* memory_space_get(u64 page_map) {
+	if (page_map == kernel_page_map)
+		return &kernel_space;
+	struct memory_space* space = spaces[(page_map / PAGE_SIZE) % MEMORY_SPACES];
+	while (space != NULL && space->page_map != page_map)
+		space = space->next;
+	if (space == NULL)
+		panic("memory_space_get: unknown page map %x", page_map);
+	return space;
+}
+
+static void range_update(struct memory_range* range) {
+	range->largest = range->end - range->start;
+	if (range->left != NULL && range->left->largest > range->largest)
+		range->largest = range->left->largest;
+	if (range->right != NULL && range->right->largest > range->largest)
+		range->largest = range->right->largest;
+}
+
+static void range_split(struct memory_range* tree, u64 start, struct memory_range** left, struct memory_range** right) {
+	if (tree == NULL) {
+		*left = *right = NULL;
+	} else if (tree->start < start) {
+		range_split(tree->right, start, &tree->right, right);
+		range_update(tree);
+		*left = tree;
+	} else {
+		range_split(tree->left, start, left, &tree->left);
+		range_update(tree);
+		*right = tree;
+	}
+}
+
+static struct memory_range* range_merge(struct memory_range* left, struct memory_range* right) {
+	if (left == NULL)
+		return right;
+	if (right == NULL)
+		return left;
+	if (left->priority > right->priority) {
+		left->right = range_merge(left->right, right);
+		range_update(left);
+		return left;
+	}
+	right->left = range_merge(left, right->left);
+	range_update(right);
+	return right;
+}
+
+static struct memory_range* range_pop_first(struct memory_range** tree) {
+	struct memory_range* range = *tree;
+	if (range->left != NULL) {
+		struct memory_range* first = range_pop_first(&range->left);
+		range_update(range);
+		return first;
+	}
+	*tree = range->right;
+	return range;
+}
+
+static struct memory_range* range_pop_last(struct memory_range** tree) {
+	struct memory_range* range = *tree;
+	if (range->right != NULL) {
+		struct memory_range* last = range_pop_last(&range->right);
+		range_update(range);
+		return last;
+	}
+	*tree = range->left;
+	return range;
+}
+
+static struct memory_range* range_new(u64 start, u64 end) {
+	static u64 seed = 0x9E3779B97F4A7C15;
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	struct memory_range* range = memory_object(&range_pool, sizeof(struct memory_range));
+	range->start = start;
+	range->end = end;
+	range->largest = end - start;
+	range->priority = seed;
+	range->left = NULL;
+	range->right = NULL;
+	return range;
+}
+
+static struct memory_range* range_copy(struct memory_range* range) {
+	if (range == NULL)
+		return NULL;
+	struct memory_range* copy = memory_object(&range_pool, sizeof(struct memory_range));
+	*copy = *range;
+	copy->left = range_copy(range->left);
+	copy->right = range_copy(range->right);
+	return copy;
+}
+
+static void memory_virt_reserve(u64 page_map, void* vaddr, u64 size) {
+	struct memory_space* space = memory_space_get(page_map);
+	u64 start = (u64) vaddr < space->start ? space->start : (u64) vaddr;
+	u64 end = (u64) vaddr + size * PAGE_SIZE > space->end ? space->end : (u64) vaddr + size * PAGE_SIZE;
+	if (start >= end)
+		return;
+	struct memory_range* left;
+	struct memory_range* middle;
+	struct memory_range* right;
+	range_split(space->free, start, &left, &right);
+	range_split(right, end, &middle, &right);
+
+	// Cut the range from the free ranges overlapping it on either side
+	if (left != NULL) {
+		struct memory_range* last = range_pop_last(&left);
+		if (last->end > end)
+			right = range_merge(range_new(end, last->end), right);
+		if (last->end > start)
+			last->end = start;
+		range_update(last);
+		left = range_merge(left, last);
+	}
+	while (middle != NULL) {
+		struct memory_range* range = range_pop_first(&middle);
+		if (range->end > end)
+			right = range_merge(range_new(end, range->end), right);
+		memory_object_free(&range_pool, range);
+	}
+	space->free = range_merge(left, right);
+}
+
+static void memory_virt_release(u64 page_map, void* vaddr, u64 size) {
+	struct memory_space* space = memory_space_get(page_map);
+	u64 start = (u64) vaddr < space->start ? space->start : (u64) vaddr;
+	u64 end = (u64) vaddr + size * PAGE_SIZE > space->end ? space->end : (u64) vaddr + size * PAGE_SIZE;
+	if (start >= end)
+		return;
+	struct memory_range* left;
+	struct memory_range* right;
+	range_split(space->free, start, &left, &right);
+
+	// Join with the adjacent free ranges
+	if (left != NULL) {
+		struct memory_range* last = range_pop_last(&left);
+		if (last->end == start) {
+			start = last->start;
+			memory_object_free(&range_pool, last);
+		} else {
+			left = range_merge(left, last);
+		}
+	}
+	if (right != NULL) {
+		struct memory_range* first = range_pop_first(&right);
+		if (first->start == end) {
+			end = first->end;
+			memory_object_free(&range_pool, first);
+		} else {
+			right = range_merge(first, right);
+		}
+	}
+	space->free = range_merge(range_merge(left, range_new(start, end)), right);
+}
+
+static struct memory_range* memory_virt_find(struct memory_range* range, u64 bytes) {
+	// Find the lowest free range that is large enough
+	while (range != NULL) {
+		if (range->left != NULL && range->left->largest >= bytes)
+			range = range->left;
+		else if (range->end - range->start >= bytes)
+			break;
+		else
+			range = range->right;
+	}
+	return range;
+}
+
+static void* memory_virt_alloc(u64 page_map, u64 size) {
+	// Align large areas so that they can use huge pages
+	u64 align = PAGE_SIZE;
+	if (size >= PAGE_SIZE_1GIB / PAGE_SIZE)
+		align = PAGE_SIZE_1GIB;
+	else if (size >= PAGE_SIZE_2MIB / PAGE_SIZE)
+		align = PAGE_SIZE_2MIB;
+	struct memory_space* space = memory_space_get(page_map);
+	struct memory_range* range = memory_virt_find(space->free, size * PAGE_SIZE + align - PAGE_SIZE);
+	if (range == NULL) {
+		align = PAGE_SIZE;
+		range = memory_virt_find(space->free, size * PAGE_SIZE);
+	}
+	if (range == NULL)
+		panic("memory_virt_alloc: ran out of virtual memory!?\n");
+	void* vaddr = (void*) ((range->start + align - 1) & ~(align - 1));
+	memory_virt_reserve(page_map, vaddr, size);
+	return vaddr;
+}
+
+static struct memory_space* memory_space_new(u64 page_map) {
+	struct memory_space* space = memory_object(&space_pool, sizeof(struct memory_space));
+	space->page_map = page_map;
+	space->start = 0x1000;
+	space->end = MEM_AT_KERN(0);
+	space->free = range_new(space->start, space->end);
+	struct memory_space** bucket = &spaces[(page_map / PAGE_SIZE) % MEMORY_SPACES];
+	space->next = *bucket;
+	*bucket = space;
+	return space;
+}
+
+static void memory_space_free(u64 page_map) {
+	struct memory_space** bucket = &spaces[(page_map / PAGE_SIZE) % MEMORY_SPACES];
+	while ((*bucket)->page_map != page_map)
+		bucket = &(*bucket)->next;
+	struct memory_space* space = *bucket;
+	*bucket = space->next;
+	while (space->free != NULL)
+		memory_object_free(&range_pool, range_pop_first(&space->free));
+	memory_object_free(&space_pool, space);
+}
+
+static void memory_space_init() {
+	// Collect the unmapped parts of the kernel half, skipping whole missing
+	// tables at a time
+	kernel_space.page_map = kernel_page_map;
+	kernel_space.start = MEM_AT_KERN(0);
+	kernel_space.end = MEM_AT_PHYS(0);
+	struct page_table* p4 = (void*) MEM_AT_PHYS(kernel_page_map);
+	u64 vaddr = MEM_AT_KERN(0);
+	u64 free_start = vaddr;
+	while (vaddr < MEM_AT_PHYS(0)) {
+		u64 step = PAGE_SIZE;
+		bool mapped = true;
 		struct page_table_entry* p4e = &p4->entry[P4_INDEX(vaddr)];
-		if (!p4e->present)
-			continue;
 		struct page_table* p3 = (void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE);
 		struct page_table_entry* p3e = &p3->entry[P3_INDEX(vaddr)];
-		if (!p3e->present)
-			continue;
-		if (p3e->huge)
-			return true;
-		struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
-		struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
-		if (!p2e->present)
-			continue;
-		if (p2e->huge)
-			return true;
-		struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
-		struct page_table_entry* p1e = &p1->entry[P1_INDEX(vaddr)];
-		if (p1e->present)
-			return true;
+		if (!p3e->present || p3e->huge) {
+			step = PAGE_SIZE_1GIB;
+			mapped = p3e->present;
+		} else {
+			struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
+			struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
+			if (!p2e->present || p2e->huge) {
+				step = PAGE_SIZE_2MIB;
+				mapped = p2e->present;
+			} else {
+				struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
+				mapped = p1->entry[P1_INDEX(vaddr)].present;
+			}
+		}
+		if (mapped) {
+			if (free_start < vaddr)
+				memory_virt_release(kernel_page_map, (void*) free_start, (vaddr - free_start) / PAGE_SIZE);
+			free_start = vaddr + step;
+		}
+		vaddr += step;
 	}
-	return false;
+	if (free_start < vaddr)
+		memory_virt_release(kernel_page_map, (void*) free_start, (vaddr - free_start) / PAGE_SIZE);
 }
 
-static void* memory_virt_alloc(u64 page_map, u64 size) {
-	u64 vaddr = page_map == kernel_page_map ? MEM_AT_KERN(0) : 0x1000;
-	u64 limit = page_map == kernel_page_map ? MEM_AT_PHYS(0) : MEM_AT_KERN(0);
-	for (; vaddr < limit; vaddr += PAGE_SIZE)
-		if (!memory_virt_used(page_map, (void*) vaddr, size))
-			return (void*) vaddr;
-	panic("memory_virt_alloc: ran out of virtual memory!?\n");
+static struct page_table* memory_table(struct page_table_entry* entry) {
+	if (!entry->present) {
+		entry->present = 1;
+		entry->writable = 1;
+		entry->user_accessible = 0;
+		entry->huge = 0;
+		entry->frame = memory_frame_alloc(1) / PAGE_SIZE;
+		memset((void*) MEM_AT_PHYS(entry->frame * PAGE_SIZE), 0, PAGE_SIZE);
+	}
+	return (void*) MEM_AT_PHYS(entry->frame * PAGE_SIZE);
 }
 
-void* memory_map(u64 page_map, u64 paddr, void* vaddr, u64 count) {
-	if (vaddr == NULL)
-		vaddr = memory_virt_alloc(page_map, count);
-	void* addr = vaddr;
+static void memory_map_huge(struct page_table_entry* entry, u64 paddr) {
+	entry->present = 1;
+	entry->writable = 1;
+	entry->user_accessible = 0;
+	entry->huge = 1;
+	entry->frame = paddr / PAGE_SIZE;
+}
+
+// Uses 1 GiB and 2 MiB pages wherever both addresses are aligned to them
+static void memory_map_pages(u64 page_map, u64 paddr, void* vaddr, u64 count) {
 	assert(P0_INDEX(paddr) == 0);
 	assert(P0_INDEX(vaddr) == 0);
 	struct page_table* p4 = (struct page_table*) MEM_AT_PHYS(page_map);
-	while (count--) {
-		struct page_table_entry* p4e = &p4->entry[P4_INDEX(vaddr)];
-		if (!p4e->present) {
-			p4e->present = 1;
-			p4e->writable = 1;
-			p4e->user_accessible = 0;
-			p4e->frame = memory_frame_alloc(1) / PAGE_SIZE;
-			memset((void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE), 0, PAGE_SIZE);
-		}
-
-		struct page_table* p3 = (void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE);
+	// The kernel half is the same in every page map
+	bool global = (u64) vaddr >= MEM_AT_KERN(0);
+	while (count > 0) {
+		struct page_table* p3 = memory_table(&p4->entry[P4_INDEX(vaddr)]);
 		struct page_table_entry* p3e = &p3->entry[P3_INDEX(vaddr)];
-		if (!p3e->present) {
-			p3e->present = 1;
-			p3e->writable = 1;
-			p3e->user_accessible = 0;
-			p3e->frame = memory_frame_alloc(1) / PAGE_SIZE;
-			memset((void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE), 0, PAGE_SIZE);
+		if (!p3e->present && count >= PAGE_SIZE_1GIB / PAGE_SIZE
+				&& ((paddr | (u64) vaddr) & (PAGE_SIZE_1GIB - 1)) == 0) {
+			memory_map_huge(p3e, paddr);
+			p3e->global = global;
+			invlpg(vaddr);
+			vaddr += PAGE_SIZE_1GIB;
+			paddr += PAGE_SIZE_1GIB;
+			count -= PAGE_SIZE_1GIB / PAGE_SIZE;
+			continue;
 		}
+		if (p3e->present && p3e->huge)
+			panic("memory_map: attempted to remap %x", vaddr);
 
-		struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
+		struct page_table* p2 = memory_table(p3e);
 		struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
-		if (!p2e->present) {
-			p2e->present = 1;
-			p2e->writable = 1;
-			p2e->user_accessible = 0;
-			p2e->frame = memory_frame_alloc(1) / PAGE_SIZE;
-			memset((void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE), 0, PAGE_SIZE);
+		if (!p2e->present && !p2e->lazy && count >= PAGE_SIZE_2MIB / PAGE_SIZE
+				&& ((paddr | (u64) vaddr) & (PAGE_SIZE_2MIB - 1)) == 0) {
+			memory_map_huge(p2e, paddr);
+			p2e->global = global;
+			invlpg(vaddr);
+			vaddr += PAGE_SIZE_2MIB;
+			paddr += PAGE_SIZE_2MIB;
+			count -= PAGE_SIZE_2MIB / PAGE_SIZE;
+			continue;
 		}
+		if ((p2e->present && p2e->huge) || p2e->lazy)
+			panic("memory_map: attempted to remap %x", vaddr);
 
-		struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
+		struct page_table* p1 = memory_table(p2e);
 		struct page_table_entry* p1e = &p1->entry[P1_INDEX(vaddr)];
-		if (p1e->present)
+		if (p1e->present || p1e->lazy)
 			panic("memory_map: attempted to remap %x", vaddr);
 		p1e->present = 1;
 		p1e->writable = 1;
 		p1e->user_accessible = 0;
+		p1e->global = global;
 		p1e->frame = paddr / PAGE_SIZE;
 
 		invlpg(vaddr);
 		vaddr += PAGE_SIZE;
 		paddr += PAGE_SIZE;
+		count--;
+	}
+}
+
+// Only reserves the pages, aligned 2 MiB stretches get a single huge entry
+static void memory_map_lazy(u64 page_map, void* vaddr, u64 count) {
+	struct page_table* p4 = (struct page_table*) MEM_AT_PHYS(page_map);
+	while (count > 0) {
+		struct page_table* p3 = memory_table(&p4->entry[P4_INDEX(vaddr)]);
+		struct page_table_entry* p3e = &p3->entry[P3_INDEX(vaddr)];
+		if (p3e->present && p3e->huge)
+			panic("memory_map: attempted to remap %x", vaddr);
+
+		struct page_table* p2 = memory_table(p3e);
+		struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
+		if (!p2e->present && !p2e->lazy && count >= PAGE_SIZE_2MIB / PAGE_SIZE
+				&& ((u64) vaddr & (PAGE_SIZE_2MIB - 1)) == 0) {
+			p2e->lazy = 1;
+			p2e->huge = 1;
+			vaddr += PAGE_SIZE_2MIB;
+			count -= PAGE_SIZE_2MIB / PAGE_SIZE;
+			continue;
+		}
+		if ((p2e->present && p2e->huge) || p2e->lazy)
+			panic("memory_map: attempted to remap %x", vaddr);
+
+		struct page_table* p1 = memory_table(p2e);
+		struct page_table_entry* p1e = &p1->entry[P1_INDEX(vaddr)];
+		if (p1e->present || p1e->lazy)
+			panic("memory_map: attempted to remap %x", vaddr);
+		p1e->lazy = 1;
+		vaddr += PAGE_SIZE;
+		count--;
 	}
-	return addr;
+}
+
+void* memory_map(u64 page_map, u64 paddr, void* vaddr, u64 count) {
+	if (vaddr == NULL)
+		vaddr = memory_virt_alloc(page_map, count);
+	else
+		memory_virt_reserve(page_map, vaddr, count);
+	memory_map_pages(page_map, paddr, vaddr, count);
+	return vaddr;
 }
 
 static bool table_is_empty(struct page_table* table) {
 	for (int i = 0; i < 512; i++)
-		if (table->entry[i].present)
+		if (table->entry[i].present || table->entry[i].lazy)
 			return false;
 	return true;
 }
 
-void memory_unmap(u64 page_map, void* vaddr, u64 page_count) {
+// Turn a huge page into a table of the next smaller pages mapping the same
+// memory, so that part of it can be unmapped
+static void memory_split(struct page_table_entry* entry, u64 size) {
+	u64 paddr = entry->frame * PAGE_SIZE;
+	u64 table = memory_frame_alloc(1);
+	struct page_table* split = (void*) MEM_AT_PHYS(table);
+	memset(split, 0, PAGE_SIZE);
+	for (int i = 0; i < 512; i++) {
+		split->entry[i].present = entry->present;
+		split->entry[i].lazy = entry->lazy;
+		split->entry[i].writable = entry->writable;
+		split->entry[i].user_accessible = entry->user_accessible;
+		split->entry[i].global = entry->global;
+		split->entry[i].huge = size > PAGE_SIZE_2MIB;
+		if (entry->present)
+			split->entry[i].frame = (paddr + i * (size / 512)) / PAGE_SIZE;
+	}
+	entry->present = 1;
+	entry->lazy = 0;
+	entry->writable = 1;
+	entry->huge = 0;
+	entry->frame = table / PAGE_SIZE;
+}
+
+static void memory_release(u64 page_map, void* vaddr, u64 size, bool free) {
 	assert(P0_INDEX(vaddr) == 0);
+	// Other processors may hold translations of the kernel's mappings
+	bool kernel = page_map == kernel_page_map || (u64) vaddr >= MEM_AT_KERN(0);
+	if (kernel)
+		smp_tlb_invalidate();
+	memory_virt_release(page_map, vaddr, size);
 	struct page_table* p4 = (void*) MEM_AT_PHYS(page_map);
-	for (u64 page = 0; page < page_count; page++) {
+	while (size > 0) {
+		u64 pages = 1;
 		struct page_table_entry* p4e = &p4->entry[P4_INDEX(vaddr)];
+		struct page_table* p3 = NULL;
+		struct page_table_entry* p3e = NULL;
+		struct page_table* p2 = NULL;
+		struct page_table_entry* p2e = NULL;
+		struct page_table* p1 = NULL;
+		struct page_table_entry* entry = NULL;
 		if (!p4e->present)
-			return;
-		struct page_table* p3 = (void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE);
-		struct page_table_entry* p3e = &p3->entry[P3_INDEX(vaddr)];
+			goto missing;
+		p3 = (void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE);
+		p3e = &p3->entry[P3_INDEX(vaddr)];
 		if (!p3e->present)
-			return;
+			goto missing;
 		if (p3e->huge) {
-			p3e->present = false;
-			if (table_is_empty(p3)) {
-				p4e->present = false;
-				memory_frame_free(p4e->frame, 1);
+			if (((u64) vaddr & (PAGE_SIZE_1GIB - 1)) == 0 && size >= PAGE_SIZE_1GIB / PAGE_SIZE) {
+				entry = p3e;
+				pages = PAGE_SIZE_1GIB / PAGE_SIZE;
+				goto release;
 			}
-			invlpg(vaddr);
-			vaddr += PAGE_SIZE_1GIB;
-			continue;
+			memory_split(p3e, PAGE_SIZE_1GIB);
 		}
-		struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
-		struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
-		if (!p2e->present)
-			return;
+		p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
+		p2e = &p2->entry[P2_INDEX(vaddr)];
+		if (!p2e->present && !p2e->lazy)
+			goto missing;
 		if (p2e->huge) {
-			p2e->present = false;
-			if (table_is_empty(p2)) {
-				p3e->present = false;
-				memory_frame_free(p3e->frame, 1);
-				if (table_is_empty(p3)) {
-					p4e->present = false;
-					memory_frame_free(p4e->frame, 1);
-				}
+			if (((u64) vaddr & (PAGE_SIZE_2MIB - 1)) == 0 && size >= PAGE_SIZE_2MIB / PAGE_SIZE) {
+				entry = p2e;
+				pages = PAGE_SIZE_2MIB / PAGE_SIZE;
+				goto release;
 			}
-			invlpg(vaddr);
-			vaddr += PAGE_SIZE_2MIB;
-			continue;
+			memory_split(p2e, PAGE_SIZE_2MIB);
 		}
-		struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
-		struct page_table_entry* p1e = &p1->entry[P1_INDEX(vaddr)];
-		if (!p1e->present)
-			return;
-		p1e->present = false;
-		if (table_is_empty(p1)) {
-			p2e->present = false;
+		p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
+		entry = &p1->entry[P1_INDEX(vaddr)];
+		if (!entry->present && !entry->lazy)
+			goto missing;
+
+		release:
+		if (free && entry->present)
+			memory_frame_free(entry->frame, pages);
+		*entry = (struct page_table_entry) { 0 };
+		// Drop the tables that became empty
+		if (p1 != NULL && table_is_empty(p1)) {
 			memory_frame_free(p2e->frame, 1);
-			if (table_is_empty(p2)) {
-				p3e->present = false;
-				memory_frame_free(p3e->frame, 1);
-				if (table_is_empty(p3)) {
-					p4e->present = false;
-					memory_frame_free(p4e->frame, 1);
-				}
-			}
+			*p2e = (struct page_table_entry) { 0 };
+		}
+		if (p2 != NULL && table_is_empty(p2)) {
+			memory_frame_free(p3e->frame, 1);
+			*p3e = (struct page_table_entry) { 0 };
+		}
+		if (table_is_empty(p3)) {
+			memory_frame_free(p4e->frame, 1);
+			*p4e = (struct page_table_entry) { 0 };
 		}
-
 		invlpg(vaddr);
+		vaddr += pages * PAGE_SIZE;
+		size -= pages;
+		continue;
+
+		missing:
+		if (free)
+			panic("memory_free: already free");
 		vaddr += PAGE_SIZE;
+		size--;
 	}
+	// Or of a page map its threads share
+	if (!kernel)
+		smp_tlb_shootdown(page_map);
+}
+
+void memory_unmap(u64 page_map, void* vaddr, u64 page_count) {
+	memory_release(page_map, vaddr, page_count, false);
 }
 
 void* memory_alloc(u64 page_map, void* vaddr, u64 size) {
 	if (vaddr == NULL)
 		vaddr = memory_virt_alloc(page_map, size);
+	else
+		memory_virt_reserve(page_map, vaddr, size);
 	assert(P0_INDEX(vaddr) == 0);
-	for (void* addr = vaddr; size--; addr += PAGE_SIZE)
-		memory_map(page_map, memory_frame_alloc(1), addr, 1);
+	// Process memory is only backed once it is touched
+	if (page_map != kernel_page_map) {
+		memory_map_lazy(page_map, vaddr, size);
+		return vaddr;
+	}
+	void* addr = vaddr;
+	while (size > 0) {
+		// Back aligned stretches with huge pages while there are free blocks
+		u64 pages = 1;
+		u64 frame = 0;
+		if (((u64) addr & (PAGE_SIZE_1GIB - 1)) == 0 && size >= PAGE_SIZE_1GIB / PAGE_SIZE)
+			frame = frame_take(18);
+		if (frame != 0)
+			pages = PAGE_SIZE_1GIB / PAGE_SIZE;
+		else if (((u64) addr & (PAGE_SIZE_2MIB - 1)) == 0 && size >= PAGE_SIZE_2MIB / PAGE_SIZE)
+			frame = frame_take(9);
+		if (frame != 0 && pages == 1)
+			pages = PAGE_SIZE_2MIB / PAGE_SIZE;
+		if (frame == 0)
+			frame = memory_frame_alloc(1) / PAGE_SIZE;
+		memory_map_pages(page_map, frame * PAGE_SIZE, addr, pages);
+		addr += pages * PAGE_SIZE;
+		size -= pages;
+	}
 	return vaddr;
 }
 
@@ -261,13 +829,13 @@ static u64 memory_translate(u64 page_map, void* vaddr) {
 	if (!p3e->present)
 		return 0;
 	if (p3e->huge)
-		return p3e->frame * PAGE_SIZE_1GIB;
+		return p3e->frame * PAGE_SIZE + ((u64) vaddr & (PAGE_SIZE_1GIB - 1));
 	struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
 	struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
 	if (!p2e->present)
 		return 0;
 	if (p2e->huge)
-		return p2e->frame * PAGE_SIZE_2MIB;
+		return p2e->frame * PAGE_SIZE + ((u64) vaddr & (PAGE_SIZE_2MIB - 1));
 	struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
 	struct page_table_entry* p1e = &p1->entry[P1_INDEX(vaddr)];
 	if (!p1e->present)
@@ -275,55 +843,111 @@ static u64 memory_translate(u64 page_map, void* vaddr) {
 	return p1e->frame * PAGE_SIZE + P0_INDEX(vaddr);
 }
 
+static u64 memory_zero_frame() {
+	if (zero_count > 0)
+		return zero_frames[--zero_count];
+	u64 frame = memory_frame_alloc(1);
+	memset((void*) MEM_AT_PHYS(frame), 0, PAGE_SIZE);
+	return frame;
+}
+
+void memory_prezero() {
+	while (zero_count < MEMORY_ZERO_POOL) {
+		u64 frame = memory_frame_alloc(1);
+		memset((void*) MEM_AT_PHYS(frame), 0, PAGE_SIZE);
+		zero_frames[zero_count++] = frame;
+	}
+}
+
+// Give a copy-on-write page a frame of its own, or just take the frame back
+// once nobody else shares it
+static void memory_unshare(struct page_table_entry* entry, void* vaddr) {
+	if (frame_refs[entry->frame] > 0) {
+		u64 frame = memory_frame_alloc(1);
+		memcpy((void*) MEM_AT_PHYS(frame), (void*) MEM_AT_PHYS(entry->frame * PAGE_SIZE), PAGE_SIZE);
+		frame_refs[entry->frame]--;
+		entry->frame = frame / PAGE_SIZE;
+	}
+	entry->cow = 0;
+	entry->writable = 1;
+	invlpg(vaddr);
+}
+
+// Back a lazy page or unshare a copy-on-write one, returns false if the
+// fault wasn't ours to handle
+static bool memory_populate(u64 page_map, void* vaddr) {
+	struct page_table* p4 = (void*) MEM_AT_PHYS(page_map);
+	struct page_table_entry* p4e = &p4->entry[P4_INDEX(vaddr)];
+	if (!p4e->present)
+		return false;
+	struct page_table* p3 = (void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE);
+	struct page_table_entry* p3e = &p3->entry[P3_INDEX(vaddr)];
+	if (!p3e->present || p3e->huge)
+		return false;
+	struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
+	struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
+	if (p2e->lazy) {
+		u64 frame = frame_take(9);
+		if (frame != 0) {
+			memset((void*) MEM_AT_PHYS(frame * PAGE_SIZE), 0, PAGE_SIZE_2MIB);
+			p2e->lazy = 0;
+			memory_map_huge(p2e, frame * PAGE_SIZE);
+			invlpg(vaddr);
+			return true;
+		}
+		memory_split(p2e, PAGE_SIZE_2MIB);
+	}
+	// Another thread may have dealt with the page while this one waited
+	if (p2e->present && p2e->huge)
+		return p2e->writable;
+	if (!p2e->present)
+		return false;
+	struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
+	struct page_table_entry* p1e = &p1->entry[P1_INDEX(vaddr)];
+	if (p1e->present && p1e->cow) {
+		memory_unshare(p1e, vaddr);
+		smp_tlb_shootdown(page_map);
+		return true;
+	}
+	if (p1e->present)
+		return p1e->writable;
+	if (!p1e->lazy)
+		return false;
+	p1e->lazy = 0;
+	p1e->present = 1;
+	p1e->writable = 1;
+	p1e->user_accessible = 0;
+	p1e->frame = memory_zero_frame() / PAGE_SIZE;
+	invlpg(vaddr);
+	return true;
+}
+
+bool memory_fault(void* vaddr) {
+	if ((u64) vaddr >= MEM_AT_KERN(0))
+		return false;
+	return memory_populate(memory_pm_get(), (void*) ((u64) vaddr & ~(PAGE_SIZE - 1)));
+}
+
+// Back or unshare pages up front, for memory that must not fault later
+void memory_prefault(u64 page_map, void* vaddr, u64 size) {
+	for (u64 page = 0; page < size; page++)
+		memory_populate(page_map, vaddr + page * PAGE_SIZE);
+}
+
 void* memory_share(u64 pmd, u64 pms, void* vaddr, u64 size) {
 	assert(P0_INDEX(vaddr) == 0);
 	void* addr = memory_virt_alloc(pmd, size);
 	for (u64 page = 0; page < size; page++) {
 		u64 paddr = memory_translate(pms, vaddr + PAGE_SIZE * page);
-		memory_map(pmd, paddr, addr + PAGE_SIZE * page, 1);
+		if (paddr == 0 && memory_populate(pms, vaddr + PAGE_SIZE * page))
+			paddr = memory_translate(pms, vaddr + PAGE_SIZE * page);
+		memory_map_pages(pmd, paddr, addr + PAGE_SIZE * page, 1);
 	}
 	return addr;
 }
 
 void memory_free(u64 page_map, void* vaddr, u64 size) {
-	assert(P0_INDEX(vaddr) == 0);
-	struct page_table* p4 = (void*) MEM_AT_PHYS(page_map);
-	while (size--) {
-		struct page_table_entry* p4e = &p4->entry[P4_INDEX(vaddr)];
-		if (!p4e->present)
-			panic("memory_free: already free");
-		struct page_table* p3 = (void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE);
-		struct page_table_entry* p3e = &p3->entry[P3_INDEX(vaddr)];
-		if (!p3e->present)
-			panic("memory_free: already free");
-		if (p3e->huge)
-			panic("memory_free: huge p3e");
-		struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
-		struct page_table_entry* p2e = &p2->entry[P2_INDEX(vaddr)];
-		if (!p2e->present)
-			panic("memory_free: already free");
-		if (p2e->huge)
-			panic("memory_free: huge p2e");
-		struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
-		struct page_table_entry* p1e = &p1->entry[P1_INDEX(vaddr)];
-		if (!p1e->present)
-			panic("memory_free: already free");
-		p1e->present = false;
-		memory_frame_free(p1e->frame, 1);
-		if (table_is_empty(p1)) {
-			p2e->present = false;
-			memory_frame_free(p2e->frame, 1);
-			if (table_is_empty(p2)) {
-				p3e->present = false;
-				memory_frame_free(p3e->frame, 1);
-				if (table_is_empty(p3)) {
-					p4e->present = false;
-					memory_frame_free(p4e->frame, 1);
-				}
-			}
-		}
-		vaddr += PAGE_SIZE;
-	}
+	memory_release(page_map, vaddr, size, true);
 }
 
 /*
@@ -333,7 +957,7 @@ void memory_free(u64 page_map, void* vaddr, u64 size) {
 u64 memory_pm_get() {
 	u64 page_map;
 	asm volatile ("movq %%cr3, %0" : "=r" (page_map));
-	return page_map;
+	return page_map & ~(PAGE_SIZE - 1);
 }
 
 u64 memory_pm_new() {
@@ -342,10 +966,62 @@ u64 memory_pm_new() {
 	memset(p4, 0, PAGE_SIZE);
 	struct page_table* kp4 = (void*) MEM_AT_PHYS(kernel_page_map);
 	p4->entry[511] = kp4->entry[511];
+	memory_space_new(page_map);
 	return page_map;
 }
 
+// Copy a user page table for a fork, every present page ends up shared
+// read-only by both sides until one of them writes to it
+static u64 memory_clone_table(struct page_table* table, u64 level) {
+	u64 clone = memory_frame_alloc(1);
+	struct page_table* copy = (void*) MEM_AT_PHYS(clone);
+	memset(copy, 0, PAGE_SIZE);
+	for (u64 i = 0; i < 512; i++) {
+		struct page_table_entry* entry = &table->entry[i];
+		if (entry->present && entry->huge)
+			memory_split(entry, level == 3 ? PAGE_SIZE_1GIB : PAGE_SIZE_2MIB);
+		copy->entry[i] = *entry;
+		if (!entry->present)
+			continue;
+		if (level > 1) {
+			struct page_table* next = (void*) MEM_AT_PHYS(entry->frame * PAGE_SIZE);
+			copy->entry[i].frame = memory_clone_table(next, level - 1) / PAGE_SIZE;
+			continue;
+		}
+		entry->writable = 0;
+		entry->cow = 1;
+		frame_refs[entry->frame]++;
+		copy->entry[i] = *entry;
+	}
+	return clone;
+}
+
+u64 memory_pm_clone(u64 page_map) {
+	u64 clone = memory_pm_new();
+	struct page_table* p4 = (void*) MEM_AT_PHYS(page_map);
+	struct page_table* cp4 = (void*) MEM_AT_PHYS(clone);
+	for (u64 p4i = 0; p4i < 511; p4i++) {
+		struct page_table_entry* p4e = &p4->entry[p4i];
+		if (!p4e->present)
+			continue;
+		cp4->entry[p4i] = *p4e;
+		cp4->entry[p4i].frame = memory_clone_table((void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE), 3) / PAGE_SIZE;
+	}
+
+	struct memory_space* space = memory_space_get(clone);
+	while (space->free != NULL)
+		memory_object_free(&range_pool, range_pop_first(&space->free));
+	space->free = range_copy(memory_space_get(page_map)->free);
+
+	// Drop writable translations of the now shared pages
+	if (page_map == memory_pm_get())
+		asm volatile ("movq %%cr3, %%rax; movq %%rax, %%cr3" ::: "rax", "memory");
+	smp_tlb_shootdown(page_map);
+	return clone;
+}
+
 void memory_pm_free(u64 page_map) {
+	memory_space_free(page_map);
 	struct page_table* p4 = (void*) MEM_AT_PHYS(page_map);
 	for (u64 p4i = 0; p4i < 511; p4i++) {
 		struct page_table_entry* p4e = &p4->entry[p4i];
@@ -354,13 +1030,21 @@ void memory_pm_free(u64 page_map) {
 		struct page_table* p3 = (void*) MEM_AT_PHYS(p4e->frame * PAGE_SIZE);
 		for (u64 p3i = 0; p3i < 512; p3i++) {
 			struct page_table_entry* p3e = &p3->entry[p3i];
-			if (!p3e->present || p3e->huge)
+			if (!p3e->present)
+				continue;
+			if (p3e->huge) {
+				memory_frame_free(p3e->frame, PAGE_SIZE_1GIB / PAGE_SIZE);
 				continue;
+			}
 			struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
 			for (u64 p2i = 0; p2i < 512; p2i++) {
 				struct page_table_entry* p2e = &p2->entry[p2i];
-				if (!p2e->present || p2e->huge)
+				if (!p2e->present)
+					continue;
+				if (p2e->huge) {
+					memory_frame_free(p2e->frame, PAGE_SIZE_2MIB / PAGE_SIZE);
 					continue;
+				}
 				struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
 				for (u64 p1i = 0; p1i < 512; p1i++) {
 					struct page_table_entry* p1e = &p1->entry[p1i];
@@ -376,3 +1060,57 @@ void memory_pm_free(u64 page_map) {
 	}
 	memory_frame_free(page_map / PAGE_SIZE, 1);
 }
+
+
+/*
+ * TLB
+ */
+
+static void memory_tlb_init() {
+	// Mark what the boot loader mapped of the kernel half global
+	struct page_table* p4 = (void*) MEM_AT_PHYS(kernel_page_map);
+	struct page_table* p3 = (void*) MEM_AT_PHYS(p4->entry[511].frame * PAGE_SIZE);
+	for (u64 p3i = 0; p3i < 512; p3i++) {
+		struct page_table_entry* p3e = &p3->entry[p3i];
+		if (!p3e->present || p3e->huge) {
+			p3e->global = p3e->present;
+			continue;
+		}
+		struct page_table* p2 = (void*) MEM_AT_PHYS(p3e->frame * PAGE_SIZE);
+		for (u64 p2i = 0; p2i < 512; p2i++) {
+			struct page_table_entry* p2e = &p2->entry[p2i];
+			if (!p2e->present || p2e->huge) {
+				p2e->global = p2e->present;
+				continue;
+			}
+			struct page_table* p1 = (void*) MEM_AT_PHYS(p2e->frame * PAGE_SIZE);
+			for (u64 p1i = 0; p1i < 512; p1i++)
+				p1->entry[p1i].global = p1->entry[p1i].present;
+		}
+	}
+
+	u32 a, b, c, d;
+	cpuid(1, &a, &b, &c, &d);
+	pcid_enabled = c & (1 << 17);
+	pcid_used[0] = 1;
+}
+
+// A freshly allocated PCID may still tag stale entries of its previous
+// owner, so the first switch to it must flush
+u64 memory_pcid_alloc() {
+	if (!pcid_enabled)
+		return 0;
+	for (u64 i = 0; i < MEMORY_PCIDS / 64; i++) {
+		if (pcid_used[i] == ~0ull)
+			continue;
+		u64 bit = __builtin_ctzll(~pcid_used[i]);
+		pcid_used[i] |= 1ull << bit;
+		return i * 64 + bit;
+	}
+	return 0;
+}
+
+void memory_pcid_free(u64 pcid) {
+	if (pcid != 0)
+		pcid_used[pcid / 64] &= ~(1ull << (pcid % 64));
+}
@@ -13,19 +13,31 @@
 #define PCI_FUNCTION(d) ((u8) (d))
 #define PCI_DEVICE(b, s, f) ((u32) ((b << 16) | (s << 8) | f))
 
-u32 pci_read(u32 device, u8 field, u8 size) {
+static void pci_select(u32 device, u8 field) {
 	u32 addr = 0x80000000;
 	addr |= PCI_BUS(device) << 16;
 	addr |= PCI_SLOT(device) << 11;
 	addr |= PCI_FUNCTION(device) << 8;
 	addr |= field & 0xFC;
 	out32(PCI_CONFIG_ADDRESS, addr);
+}
+
+u32 pci_read(u32 device, u8 field, u8 size) {
+	pci_select(device, field);
 	if (size == 1) return in8(PCI_CONFIG_DATA + (field & 3));
 	if (size == 2) return in16(PCI_CONFIG_DATA + (field & 2));
 	if (size == 4) return in32(PCI_CONFIG_DATA);
 	panic("invalid size for pci_read: %d\n", size);
 }
 
+void pci_write(u32 device, u8 field, u8 size, u32 data) {
+	pci_select(device, field);
+	if (size == 1) return out8(PCI_CONFIG_DATA + (field & 3), data);
+	if (size == 2) return out16(PCI_CONFIG_DATA + (field & 2), data);
+	if (size == 4) return out32(PCI_CONFIG_DATA, data);
+	panic("invalid size for pci_write: %d\n", size);
+}
+
 u32 pci_scan_bus(u16, u8);
 u32 pci_scan_function(u16 type, u8 bus, u8 slot, u8 function) {
 	u32 device = PCI_DEVICE(bus, slot, function);
@@ -6,38 +6,151 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cpu.h"
 #include "elf.h"
 #include "memory.h"
 #include "panic.h"
+#include "slab.h"
+#include "spinlock.h"
 
 struct proc* kernel_proc;
-struct proc* current_proc;
+static struct slab_cache* proc_cache;
+static u64 next_pid = 1;
+
+u64 proc_quantum = PROC_QUANTUM;
+
+// Every processor runs what is in its own ready queue and takes from the
+// others once that is empty. One lock covers the queues and every status
+// change, a switch holds it until the next process is off the old stack
+static struct spinlock proc_lock;
+static struct proc* proc_hash[PROC_HASH];
+
+void proc_entry();
+void proc_finish();
+
+static void proc_enqueue(struct cpu* cpu, struct proc* proc) {
+	proc->next = NULL;
+	if (cpu->ready_tail != NULL)
+		cpu->ready_tail->next = proc;
+	else
+		cpu->ready_head = proc;
+	cpu->ready_tail = proc;
+}
+
+static struct proc* proc_dequeue(struct cpu* cpu) {
+	struct proc* proc = cpu->ready_head;
+	if (proc != NULL) {
+		cpu->ready_head = proc->next;
+		if (cpu->ready_head == NULL)
+			cpu->ready_tail = NULL;
+	}
+	return proc;
+}
+
+static struct proc* proc_pick(struct cpu* cpu) {
+	struct proc* proc = proc_dequeue(cpu);
+	for (u64 i = 1; proc == NULL && i < cpu_count; i++)
+		proc = proc_dequeue(&cpus[(cpu->id + i) % cpu_count]);
+	return proc;
+}
+
+// Back on the processor it last ran on, whose TLB may still know it
+static void proc_ready(struct proc* proc) {
+	proc->status = PROC_READY;
+	proc_enqueue(proc->last_cpu != PROC_NO_CPU ? &cpus[proc->last_cpu] : cpu_get(), proc);
+}
+
+static struct proc* proc_find(u64 pid) {
+	struct proc* proc = proc_hash[pid % PROC_HASH];
+	while (proc != NULL && proc->pid != pid)
+		proc = proc->hash_next;
+	return proc;
+}
+
+static void proc_start(struct proc* proc) {
+	proc->pid = next_pid++;
+	proc->waiters.head = NULL;
+	proc->hash_next = proc_hash[proc->pid % PROC_HASH];
+	proc_hash[proc->pid % PROC_HASH] = proc;
+	proc->cpu = NULL;
+	proc->last_cpu = PROC_NO_CPU;
+	u64 flags = interrupts_disable();
+	spin_lock(&proc_lock);
+	proc_ready(proc);
+	spin_unlock(&proc_lock);
+	interrupts_restore(flags);
+}
+
+// A process in the kernel's page map
+static struct proc* proc_kernel() {
+	extern u64 kernel_page_map;
+	struct proc* proc = slab_alloc(proc_cache);
+	proc->cr3 = kernel_page_map;
+	proc->pcid = 0;
+	strcpy(proc->cwd, "/");
+	proc->pid = 0;
+	proc->waiters.head = NULL;
+	proc->status = PROC_RUNNING;
+	proc->group = proc;
+	proc->threads = 1;
+	proc->cpu = NULL;
+	proc->last_cpu = PROC_NO_CPU;
+	return proc;
+}
+
+static _Noreturn void proc_idle_loop() {
+	while (1)
+		proc_idle();
+}
 
 void proc_init() {
-	current_proc = malloc(sizeof(*current_proc));
-	current_proc->cr3 = memory_pm_get();
-	strcpy(current_proc->cwd, "/");
-	current_proc->pid = 0;
-	current_proc->waitpid = 0;
-	current_proc->status = PROC_RUNNING;
-	current_proc->prev = current_proc;
-	current_proc->next = current_proc;
-	kernel_proc = current_proc;
+	proc_cache = slab_create("proc", sizeof(struct proc), NULL);
+	kernel_proc = proc_kernel();
+	proc_hash[0] = kernel_proc;
+	kernel_proc->hash_next = NULL;
+	struct cpu* cpu = cpu_get();
+	kernel_proc->cpu = cpu;
+	kernel_proc->last_cpu = cpu->id;
+	cpu->proc = kernel_proc;
+
+	// The boot processor is busy with kernel_main, so its idle process
+	// starts out like a new one
+	extern u64 kernel_page_map;
+	struct proc* idle = proc_kernel();
+	idle->stack = memory_alloc(kernel_page_map, NULL, PROC_IDLE_PAGES);
+	u64* stack = idle->stack + PROC_IDLE_PAGES * PAGE_SIZE;
+	*--stack = 0;
+	*--stack = (u64) proc_idle_loop;
+	*--stack = (u64) proc_entry;
+	*--stack = 0x2;
+	idle->rsp = (u64) stack;
+	idle->status = PROC_READY;
+	cpu->idle = idle;
+}
+
+// The other processors idle in what they are already running
+void proc_init_cpu(struct cpu* cpu) {
+	struct proc* idle = proc_kernel();
+	idle->cpu = cpu;
+	idle->last_cpu = cpu->id;
+	cpu->proc = idle;
+	cpu->idle = idle;
 }
 
 u64 proc_exec(const char* path, const char** argv) {
-	struct proc* proc = malloc(sizeof(*proc));
+	struct proc* proc = slab_alloc(proc_cache);
 	proc->cr3 = memory_pm_new();
 
 	void* entry = elf_load(proc->cr3, path);
 	if (entry == NULL) {
 		memory_pm_free(proc->cr3);
-		free(proc);
+		slab_free(proc_cache, proc);
 		return 0;
 	}
 
-	proc->stack = memory_alloc(proc->cr3, NULL, 2);
-	u64* stack = memory_share(memory_pm_get(), proc->cr3, proc->stack, 2);
+	proc->pcid = memory_pcid_alloc();
+	proc->stack = memory_alloc(proc->cr3, NULL, PROC_STACK_PAGES);
+	u64* stack = memory_share(memory_pm_get(), proc->cr3, proc->stack, PROC_STACK_PAGES);
 
 	u64 argc; for (argc = 0; argv && argv[argc]; argc++);
 	u64 offset = argc * sizeof(char*);
@@ -48,87 +161,287 @@ u64 proc_exec(const char* path, const char** argv) {
 		offset += len;
 	}
 
-	u64 sp = 1024;
+	u64 sp = PROC_STACK_PAGES * PAGE_SIZE / sizeof(u64);
 	stack[--sp] = (u64) proc->stack;
 	stack[--sp] = (u64) argc;
 	stack[--sp] = (u64) stdout;
 	stack[--sp] = (u64) stdin;
 	stack[--sp] = (u64) entry;
-	stack[--sp] = (u64) 0;
+	stack[--sp] = (u64) proc_entry;
+	stack[--sp] = (u64) 0x2;
 	proc->rsp = (u64) proc->stack + sizeof(u64) * sp;
-	memory_unmap(memory_pm_get(), stack, 2);
+	memory_unmap(memory_pm_get(), stack, PROC_STACK_PAGES);
 
-	static u64 pid = 1;
-	strncpy(proc->cwd, current_proc->cwd, sizeof(proc->cwd));
-	proc->pid = pid++;
-	proc->waitpid = 0;
-	proc->status = PROC_READY;
-	proc->prev = current_proc;
-	proc->next = current_proc->next;
-	current_proc->next->prev = proc;
-	current_proc->next = proc;
+	strncpy(proc->cwd, current_proc->group->cwd, sizeof(proc->cwd));
+	proc->group = proc;
+	proc->threads = 1;
+	proc_start(proc);
+	return proc->pid;
+}
+
+void proc_clone_memory(struct proc* proc) {
+	proc->cr3 = memory_pm_clone(proc->cr3);
+}
+
+u64 proc_clone(struct proc*);
+u64 proc_fork() {
+	struct proc* proc = slab_alloc(proc_cache);
+	memcpy(proc, current_proc, sizeof(*proc));
+	u64 depth = kernel_depth();
+	u64 flags = interrupts_disable();
+	bool child = proc_clone(proc);
+	if (child) {
+		proc_finish();
+		kernel_reacquire(depth);
+		interrupts_restore(flags);
+		return 0;
+	}
+	// Interrupts are taken on the program's stack, so unshare both stacks
+	// before one can arrive on a read-only page
+	memory_prefault(current_proc->cr3, current_proc->stack, PROC_STACK_PAGES);
+	memory_prefault(proc->cr3, proc->stack, PROC_STACK_PAGES);
+	interrupts_restore(flags);
 
+	// Only the calling thread is copied
+	proc->pcid = memory_pcid_alloc();
+	strncpy(proc->cwd, current_proc->group->cwd, sizeof(proc->cwd));
+	proc->group = proc;
+	proc->threads = 1;
+	proc_start(proc);
+	return proc->pid;
+}
+
+// Runs entry(arg0, arg1) on a stack of its own, entry ends in proc_exit
+// rather than returning
+u64 proc_thread_create(void* entry, u64 arg0, u64 arg1) {
+	struct proc* group = current_proc->group;
+	// Threads on different processors would each keep translations under
+	// the PCID, which a shootdown couldn't reach once they switch away, so
+	// a shared page map goes without one
+	if (group->pcid != 0) {
+		memory_pcid_free(group->pcid & (PAGE_SIZE - 1));
+		group->pcid = 0;
+	}
+
+	struct proc* proc = slab_alloc(proc_cache);
+	proc->cr3 = group->cr3;
+	proc->pcid = 0;
+	// Neither the start of the switch to it nor interrupts may fault on it
+	proc->stack = memory_alloc(proc->cr3, NULL, PROC_STACK_PAGES);
+	memory_prefault(proc->cr3, proc->stack, PROC_STACK_PAGES);
+	u64* stack = proc->stack + PROC_STACK_PAGES * PAGE_SIZE;
+	*--stack = 0;
+	*--stack = (u64) entry;
+	*--stack = (u64) proc_entry;
+	*--stack = 0x2;
+	proc->rsp = (u64) stack;
+	proc->rdi = arg0;
+	proc->rsi = arg1;
+
+	proc->group = group;
+	group->threads++;
+	proc_start(proc);
 	return proc->pid;
 }
 
 void proc_switch(struct proc*, struct proc*);
-void proc_yield() {
-	struct proc* next = current_proc->next;
-	while (1) {
-		if (next->waitpid == 0 && next->status == PROC_READY)
-			break;
-		if (next == current_proc)
-			return;
-		next = next->next;
+// Returns false if there was nothing else to run
+bool proc_yield() {
+	u64 flags = interrupts_disable();
+	struct cpu* cpu = cpu_get();
+	struct proc* curr = cpu->proc;
+	spin_lock(&proc_lock);
+	struct proc* next = proc_pick(cpu);
+	if (next == NULL && curr->status != PROC_RUNNING)
+		next = cpu->idle;
+	if (next == NULL) {
+		spin_unlock(&proc_lock);
+		interrupts_restore(flags);
+		return false;
 	}
 
-	struct proc* curr = current_proc;
-	if (curr->status == PROC_RUNNING)
-		curr->status = PROC_READY;
+	if (curr->status == PROC_RUNNING && curr != cpu->idle)
+		proc_ready(curr);
 	next->status = PROC_RUNNING;
+	curr->cpu = NULL;
+	next->cpu = cpu;
+	// Entries tagged with its PCID here are stale if it ran elsewhere since
+	if (next->last_cpu != cpu->id)
+		next->pcid &= ~PROC_PCID_FLUSHED;
+	next->last_cpu = cpu->id;
+	cpu->proc = next;
+	cpu->slice = 0;
 
-	current_proc = next;
+	// Possibly resuming on another processor
+	u64 depth = kernel_release();
 	proc_switch(curr, next);
+	proc_finish();
+	kernel_reacquire(depth);
+	interrupts_restore(flags);
+	return true;
+}
+
+// The other half of a switch, where a process starts or resumes
+void proc_finish() {
+	spin_unlock(&proc_lock);
+}
+
+// Called on every timer tick, from interrupt context
+void proc_tick(bool preemptible) {
+	if (++cpu_get()->slice >= proc_quantum && preemptible)
+		proc_yield();
+}
+
+// Halt until an interrupt if there is nothing else to run
+void proc_idle() {
+	if (proc_yield())
+		return;
+	u64 flags = interrupts_disable();
+	u64 depth = kernel_release();
+	asm volatile ("sti; hlt; cli");
+	kernel_reacquire(depth);
+	interrupts_restore(flags);
+}
+
+// With the status set, until proc_wake
+static void proc_suspend() {
+	while (current_proc->status == PROC_BLOCKED)
+		proc_yield();
+}
+
+static void proc_unblock_locked(struct proc* proc) {
+	// One that hasn't switched away yet just keeps running
+	if (proc->status == PROC_BLOCKED && proc->cpu != NULL)
+		proc->status = PROC_RUNNING;
+	else if (proc->status == PROC_BLOCKED)
+		proc_ready(proc);
+}
+
+// The caller checks its condition again after waking up, with interrupts
+// disabled and the kernel lock held in between so a wakeup from an interrupt
+// or another processor can't get lost
+void proc_sleep(struct wait_queue* queue) {
+	u64 flags = interrupts_disable();
+	spin_lock(&proc_lock);
+	current_proc->wait_next = queue->head;
+	queue->head = current_proc;
+	current_proc->status = PROC_BLOCKED;
+	spin_unlock(&proc_lock);
+	proc_suspend();
+	interrupts_restore(flags);
+}
+
+void proc_wake(struct wait_queue* queue) {
+	u64 flags = interrupts_disable();
+	spin_lock(&proc_lock);
+	for (struct proc* proc = queue->head; proc != NULL; proc = proc->wait_next)
+		proc_unblock_locked(proc);
+	queue->head = NULL;
+	spin_unlock(&proc_lock);
+	interrupts_restore(flags);
 }
 
 void proc_exit(u64 ret) {
 	if (current_proc->pid == 0)
 		panic("attempted to exit kernel");
 	current_proc->ret = ret;
+	u64 flags = interrupts_disable();
+	spin_lock(&proc_lock);
 	current_proc->status = PROC_DONE;
-	struct proc* proc = current_proc->next;
-	while (proc != current_proc) {
-		if (proc->waitpid == current_proc->pid)
-			proc->waitpid = 0;
-		proc = proc->next;
+	spin_unlock(&proc_lock);
+	interrupts_restore(flags);
+	// Whoever waits for the process waits for all of its threads
+	struct proc* group = current_proc->group;
+	group->threads--;
+	proc_wake(&current_proc->waiters);
+	if (group->threads == 0 && group != current_proc)
+		proc_wake(&group->waiters);
+	while (1)
+		proc_yield();
+}
+
+// Until its processor is done switching away from it
+static bool proc_running(struct proc* proc) {
+	u64 flags = interrupts_disable();
+	spin_lock(&proc_lock);
+	bool running = proc->cpu != NULL;
+	spin_unlock(&proc_lock);
+	interrupts_restore(flags);
+	return running;
+}
+
+// Sleep until it is done, and for a process until all of its threads are.
+// Returns false if someone else reaped it in the meantime
+static bool proc_await(struct proc* proc) {
+	u64 pid = proc->pid;
+	u64 flags = interrupts_disable();
+	while (proc->status != PROC_DONE || (proc->group == proc && proc->threads > 0)) {
+		proc_sleep(&proc->waiters);
+		if (proc_find(pid) != proc) {
+			interrupts_restore(flags);
+			return false;
+		}
 	}
-	proc_yield();
+	interrupts_restore(flags);
+	while (proc_running(proc))
+		asm volatile ("pause");
+	return true;
+}
+
+static void proc_unhash(struct proc* proc) {
+	struct proc** bucket = &proc_hash[proc->pid % PROC_HASH];
+	while (*bucket != proc)
+		bucket = &(*bucket)->hash_next;
+	*bucket = proc->hash_next;
 }
 
 u64 proc_wait(u64 pid) {
 	if (pid == 0)
 		return -1;
-	struct proc* proc = current_proc;
-	while (proc->pid != pid) {
-		proc = proc->next;
-		if (proc == current_proc)
-			return -1;
+	struct proc* proc = proc_find(pid);
+	// Threads are joined instead
+	if (proc == NULL || proc->group != proc || !proc_await(proc))
+		return -1;
+
+	// Along with the threads nobody joined
+	for (u64 i = 0; i < PROC_HASH; i++) {
+		struct proc* thread = proc_hash[i];
+		while (thread != NULL) {
+			struct proc* next = thread->hash_next;
+			if (thread->group == proc && thread != proc) {
+				while (proc_running(thread))
+					asm volatile ("pause");
+				proc_unhash(thread);
+				slab_free(proc_cache, thread);
+			}
+			thread = next;
+		}
 	}
-	current_proc->waitpid = pid;
-	proc_yield();
-	current_proc->waitpid = 0;
-	proc->prev->next = proc->next;
-	proc->next->prev = proc->prev;
+	proc_unhash(proc);
 	memory_pm_free(proc->cr3);
+	memory_pcid_free(proc->pcid & (PAGE_SIZE - 1));
+	u64 ret = proc->ret;
+	slab_free(proc_cache, proc);
+	return ret;
+}
+
+// Another thread of the same process
+u64 proc_thread_join(u64 tid) {
+	struct proc* proc = proc_find(tid);
+	if (proc == NULL || proc == current_proc || proc == proc->group
+			|| proc->group != current_proc->group || !proc_await(proc))
+		return -1;
+	proc_unhash(proc);
+	memory_free(proc->cr3, proc->stack, PROC_STACK_PAGES);
 	u64 ret = proc->ret;
-	free(proc);
+	slab_free(proc_cache, proc);
 	return ret;
 }
 
 char* proc_getcwd(char* cwd) {
 	if (cwd == NULL)
-		return strdup(current_proc->cwd);
-	strcpy(cwd, current_proc->cwd);
+		return strdup(current_proc->group->cwd);
+	strcpy(cwd, current_proc->group->cwd);
 	return cwd;
 }
 
@@ -137,7 +450,7 @@ bool proc_chdir(const char* path) {
 	std_file_t* file = std_file_open(real, 0);
 	if (file != NULL) {
 		if (file->type == STD_DIRECTORY) {
-			strncpy(current_proc->cwd, real, sizeof(current_proc->cwd));
+			strncpy(current_proc->group->cwd, real, sizeof(current_proc->group->cwd));
 			std_file_close(file);
 			free(real);
 			return true;
@@ -10,12 +10,27 @@ proc_switch:
 	movq %rdi, 40(%rdi)
 	movq %rsp, 48(%rdi)
 	movq %rbp, 56(%rdi)
-	movq %cr3, %rax
-	movq %rax, 64(%rdi)
+	movq %r12, 72(%rdi)
+	movq %r13, 80(%rdi)
+	movq %r14, 88(%rdi)
+	movq %r15, 96(%rdi)
 
-	# Load registers
+	# Load the page map, keeping the TLB entries tagged with its PCID after
+	# the first switch
+	movq 104(%rsi), %rdx
 	movq 64(%rsi), %rax
+	orq %rdx, %rax
 	movq %rax, %cr3
+	testq %rdx, %rdx
+	jz 1f
+	btsq $63, 104(%rsi)
+1:
+
+	# Load registers
+	movq 96(%rsi), %r15
+	movq 88(%rsi), %r14
+	movq 80(%rsi), %r13
+	movq 72(%rsi), %r12
 	movq 56(%rsi), %rbp
 	movq 48(%rsi), %rsp
 	movq 40(%rsi), %rdi
@@ -27,3 +42,45 @@ proc_switch:
 	popfq
 
 	retq
+
+.global proc_clone
+proc_clone:
+	# Save registers as proc_switch would, the child resumes here with 1
+	pushfq
+	movq $1,     (%rdi)
+	movq %rbx,  8(%rdi)
+	movq %rcx, 16(%rdi)
+	movq %rdx, 24(%rdi)
+	movq %rsi, 32(%rdi)
+	movq %rdi, 40(%rdi)
+	movq %rsp, 48(%rdi)
+	movq %rbp, 56(%rdi)
+	movq %r12, 72(%rdi)
+	movq %r13, 80(%rdi)
+	movq %r14, 88(%rdi)
+	movq %r15, 96(%rdi)
+
+	# Copy the address space while the stack still holds this frame
+	call proc_clone_memory
+	popfq
+
+	xorq %rax, %rax
+	retq
+
+# New processes start here, with interrupts disabled until the switch to them
+# is finished
+.global proc_entry
+proc_entry:
+	# Threads get their arguments in rdi and rsi
+	pushq %rdi
+	pushq %rsi
+	pushq %rbp
+	movq %rsp, %rbp
+	andq $-16, %rsp
+	call proc_finish
+	movq %rbp, %rsp
+	popq %rbp
+	popq %rsi
+	popq %rdi
+	sti
+	retq
@@ -0,0 +1,73 @@
+#include "slab.h"
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "memory.h"
+#include "panic.h"
+
+#define SLAB_CACHES 32
+#define SLAB_MIN_OBJECTS 8
+
+// Objects of one size, constructed once when their slab is added. Freed
+// objects keep their state apart from the first word, which links the free
+// list, and slabs are never given back
+struct slab_cache {
+	const char* name;
+	u64 size;
+	u64 pages;
+	void (*ctor)(void*);
+	void* free;
+	u64 total;
+	u64 used;
+};
+
+static struct slab_cache caches[SLAB_CACHES];
+static u64 cache_count;
+
+struct slab_cache* slab_create(const char* name, u64 size, void (*ctor)(void*)) {
+	if (cache_count == SLAB_CACHES)
+		panic("slab_create: too many caches for %s", name);
+	struct slab_cache* cache = &caches[cache_count++];
+	cache->name = name;
+	cache->size = size < sizeof(void*) ? sizeof(void*) : (size + 15) & ~15ull;
+	cache->pages = (cache->size * SLAB_MIN_OBJECTS + PAGE_SIZE - 1) / PAGE_SIZE;
+	cache->ctor = ctor;
+	cache->free = NULL;
+	cache->total = 0;
+	cache->used = 0;
+	return cache;
+}
+
+static void slab_grow(struct slab_cache* cache) {
+	extern u64 kernel_page_map;
+	u8* slab = memory_alloc(kernel_page_map, NULL, cache->pages);
+	u64 count = cache->pages * PAGE_SIZE / cache->size;
+	for (u64 i = count; i-- > 0;) {
+		void* object = slab + i * cache->size;
+		if (cache->ctor != NULL)
+			cache->ctor(object);
+		*(void**) object = cache->free;
+		cache->free = object;
+	}
+	cache->total += count;
+}
+
+void* slab_alloc(struct slab_cache* cache) {
+	u64 flags = interrupts_disable();
+	if (cache->free == NULL)
+		slab_grow(cache);
+	void* object = cache->free;
+	cache->free = *(void**) object;
+	cache->used++;
+	interrupts_restore(flags);
+	return object;
+}
+
+void slab_free(struct slab_cache* cache, void* object) {
+	u64 flags = interrupts_disable();
+	*(void**) object = cache->free;
+	cache->free = object;
+	cache->used--;
+	interrupts_restore(flags);
+}
@@ -0,0 +1,245 @@
+#include "smp.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "isr.h"
+#include "memory.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "syscall.h"
+
+#define LAPIC_ID			0x20
+#define LAPIC_EOI			0xB0
+#define LAPIC_SPURIOUS		0xF0
+#define LAPIC_ICR_LOW		0x300
+#define LAPIC_ICR_HIGH		0x310
+#define LAPIC_TIMER			0x320
+#define LAPIC_TIMER_INIT	0x380
+#define LAPIC_TIMER_CURRENT	0x390
+#define LAPIC_TIMER_DIVIDE	0x3E0
+
+#define LAPIC_ENABLE		(1 << 8)
+#define LAPIC_ICR_INIT		0x000C4500 // to all but this processor
+#define LAPIC_ICR_STARTUP	0x000C4600
+#define LAPIC_ICR_NMI		0x00004400 // to the processor in ICR_HIGH
+#define LAPIC_ICR_PENDING	(1 << 12)
+#define LAPIC_TIMER_MASKED	(1 << 16)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+
+struct smp_trampoline_data {
+	u32 cr3;
+	u32 next;
+	u64 stacks;
+} __attribute__ ((packed));
+
+struct cpu cpus[SMP_MAX_CPUS];
+u64 cpu_count = 1;
+
+static volatile u32* lapic;
+static u32 lapic_ticks; // timer count for one PIT tick
+static u64 smp_stacks[SMP_MAX_CPUS];
+
+// One lock for all of the kernel, taken on every way in. It nests, and a
+// process gives it up while switched away
+static struct spinlock kernel_spin;
+static volatile u64 kernel_owner = -1;
+static u64 kernel_count;
+static u64 tlb_generation;
+
+static inline u32 lapic_read(u32 reg) {
+	return lapic[reg / 4];
+}
+
+static inline void lapic_write(u32 reg, u32 value) {
+	lapic[reg / 4] = value;
+}
+
+static void lapic_ipi(u32 icr, u32 apic_id) {
+	lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, icr);
+	while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+		asm volatile ("pause");
+}
+
+// Counts PIT ticks, which needs interrupts enabled
+static void smp_delay(u64 ticks) {
+	u64 until = *(volatile u64*) &clock_ticks + ticks + 1;
+	while (*(volatile u64*) &clock_ticks < until)
+		asm volatile ("pause");
+}
+
+static void smp_timer_isr(struct isr_stack s) {
+	proc_tick(s.rip < MEM_AT_KERN(0));
+}
+
+void smp_eoi() {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+_Noreturn void smp_ap_main(u64 id) {
+	struct cpu* cpu = &cpus[id];
+	cpu->id = id;
+	// Below the stack are a page for exceptions and one for NMIs
+	u64 ist = smp_stacks[id] - SMP_STACK_PAGES * PAGE_SIZE;
+	segment_init_cpu(cpu, ist, ist - PAGE_SIZE);
+	syscall_init();
+	memory_cpu_init();
+	lapic_write(LAPIC_SPURIOUS, LAPIC_ENABLE | SMP_VECTOR_SPURIOUS);
+	cpu->apic_id = lapic_read(LAPIC_ID) >> 24;
+
+	kernel_lock();
+	proc_init_cpu(cpu);
+	kernel_unlock();
+
+	// Tick at the rate of the PIT on the boot processor
+	lapic_write(LAPIC_TIMER_DIVIDE, 0x3);
+	lapic_write(LAPIC_TIMER, LAPIC_TIMER_PERIODIC | SMP_VECTOR_TIMER);
+	lapic_write(LAPIC_TIMER_INIT, lapic_ticks);
+	while (1)
+		proc_idle();
+}
+
+void smp_init() {
+	extern u64 kernel_page_map;
+	lapic = memory_map(kernel_page_map, rdmsr(0x1B) & ~(PAGE_SIZE - 1), NULL, 1);
+	lapic_write(LAPIC_SPURIOUS, LAPIC_ENABLE | SMP_VECTOR_SPURIOUS);
+	cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+	isr_set(SMP_VECTOR_TIMER, smp_timer_isr);
+
+	// Measure the local timer against the PIT, counting down from the start
+	// of a tick
+	lapic_write(LAPIC_TIMER_DIVIDE, 0x3);
+	lapic_write(LAPIC_TIMER, LAPIC_TIMER_MASKED);
+	smp_delay(0);
+	lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+	smp_delay(9);
+	lapic_ticks = (0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT)) / 10;
+	lapic_write(LAPIC_TIMER_INIT, 0);
+
+	for (u64 i = 1; i < SMP_MAX_CPUS; i++)
+		smp_stacks[i] = (u64) memory_alloc(kernel_page_map, NULL, SMP_STACK_PAGES + 2) + (SMP_STACK_PAGES + 2) * PAGE_SIZE;
+
+	extern u8 smp_trampoline, smp_trampoline_data, smp_trampoline_end;
+	u8* trampoline = (u8*) MEM_AT_PHYS(SMP_TRAMPOLINE);
+	memcpy(trampoline, &smp_trampoline, &smp_trampoline_end - &smp_trampoline);
+	struct smp_trampoline_data* data = (void*) (trampoline + (&smp_trampoline_data - &smp_trampoline));
+	data->cr3 = kernel_page_map;
+	data->next = 1;
+	data->stacks = (u64) smp_stacks;
+
+	// INIT, then STARTUP twice as the MP specification has it, all of them
+	// at once
+	lapic_ipi(LAPIC_ICR_INIT, 0);
+	smp_delay(10);
+	for (u64 i = 0; i < 2; i++) {
+		lapic_ipi(LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE / PAGE_SIZE), 0);
+		smp_delay(1);
+	}
+
+	// Turn away latecomers and give the stacks nobody took back
+	smp_delay(20);
+	u64 started = __atomic_exchange_n(&data->next, SMP_MAX_CPUS, __ATOMIC_SEQ_CST);
+	if (started > SMP_MAX_CPUS)
+		started = SMP_MAX_CPUS;
+	for (u64 i = started; i < SMP_MAX_CPUS; i++)
+		memory_free(kernel_page_map, (void*) (smp_stacks[i] - (SMP_STACK_PAGES + 2) * PAGE_SIZE), SMP_STACK_PAGES + 2);
+	cpu_count = started;
+}
+
+// Every processor drops its TLB, global entries included, the next time it
+// takes the kernel lock
+void smp_tlb_invalidate() {
+	tlb_generation++;
+}
+
+// Flush the TLB of every other processor in the page map, which threads
+// share. An NMI gets through even while one waits for the kernel lock
+void smp_tlb_shootdown(u64 page_map) {
+	if (cpu_count == 1)
+		return;
+	struct cpu* self = cpu_get();
+	asm volatile ("mfence" ::: "memory");
+	for (u64 i = 0; i < cpu_count; i++) {
+		struct cpu* cpu = &cpus[i];
+		if (cpu == self || cpu->proc == NULL || cpu->proc->cr3 != page_map)
+			continue;
+		cpu->tlb_flush = true;
+		lapic_ipi(LAPIC_ICR_NMI, cpu->apic_id);
+	}
+	for (u64 i = 0; i < cpu_count; i++)
+		while (cpus[i].tlb_flush)
+			asm volatile ("pause");
+}
+
+// Returns false if the NMI wasn't a shootdown
+bool smp_nmi() {
+	struct cpu* cpu = cpu_get();
+	if (!cpu->tlb_flush)
+		return false;
+	asm volatile ("movq %%cr3, %%rax; movq %%rax, %%cr3" ::: "rax", "memory");
+	cpu->tlb_flush = false;
+	return true;
+}
+
+void kernel_lock() {
+	u64 flags = interrupts_disable();
+	struct cpu* cpu = cpu_get();
+	if (kernel_owner != cpu->id) {
+		// Interrupts may come in while waiting, as long as they did before
+		while (!spin_trylock(&kernel_spin)) {
+			interrupts_restore(flags);
+			asm volatile ("pause");
+			interrupts_disable();
+		}
+		kernel_owner = cpu->id;
+		if (cpu->tlb_generation != tlb_generation) {
+			cpu->tlb_generation = tlb_generation;
+			u64 cr4;
+			asm volatile ("movq %%cr4, %0" : "=r" (cr4));
+			asm volatile ("movq %0, %%cr4" :: "r" (cr4 & ~(1ull << 7)) : "memory");
+			asm volatile ("movq %0, %%cr4" :: "r" (cr4) : "memory");
+		}
+	}
+	kernel_count++;
+	interrupts_restore(flags);
+}
+
+void kernel_unlock() {
+	u64 flags = interrupts_disable();
+	if (--kernel_count == 0) {
+		kernel_owner = -1;
+		spin_unlock(&kernel_spin);
+	}
+	interrupts_restore(flags);
+}
+
+// How deep this processor holds the lock
+u64 kernel_depth() {
+	u64 flags = interrupts_disable();
+	u64 depth = kernel_owner == cpu_get()->id ? kernel_count : 0;
+	interrupts_restore(flags);
+	return depth;
+}
+
+// Give the lock up entirely before switching away or halting
+u64 kernel_release() {
+	u64 flags = interrupts_disable();
+	u64 depth = kernel_depth();
+	if (depth > 0) {
+		kernel_count = 0;
+		kernel_owner = -1;
+		spin_unlock(&kernel_spin);
+	}
+	interrupts_restore(flags);
+	return depth;
+}
+
+void kernel_reacquire(u64 depth) {
+	if (depth == 0)
+		return;
+	kernel_lock();
+	kernel_count = depth;
+}
@@ -0,0 +1,82 @@
+# Application processor startup, copied to SMP_TRAMPOLINE and entered in real
+# mode at its start. Addresses are of the copy, data is filled in by smp_init.
+.set TRAMPOLINE, 0x8000
+.set MAX_CPUS, 16
+
+.code16
+.global smp_trampoline
+smp_trampoline:
+	cli
+	cld
+	xor %ax, %ax
+	mov %ax, %ds
+
+	# Set PAE, PGE, OSFXSR and OSXMMEXCPT bits
+	mov $0b11010100000, %eax
+	mov %eax, %cr4
+
+	# Load the kernel's page map
+	movl (smp_cr3 - smp_trampoline + TRAMPOLINE), %edx
+	mov %edx, %cr3
+
+	# Set the LME bit
+	mov $0xC0000080, %ecx
+	rdmsr
+	or $0x100, %eax
+	wrmsr
+
+	# Clear EM and set MP bits
+	mov %cr0, %ebx
+	and $~(1 << 3), %ebx
+	or $0x80000011, %ebx
+	mov %ebx, %cr0
+
+	# Long mode jump
+	lgdtl (gdt - smp_trampoline + TRAMPOLINE)
+	ljmpl $8, $(ap64 - smp_trampoline + TRAMPOLINE)
+
+# Global Descriptor Table
+.align 8
+gdt_base:
+	.quad 0x0000000000000000
+	.quad 0x00209A0000000000
+	.quad 0x0000920000000000
+gdt:
+	.word . - gdt_base
+	.quad (gdt_base - smp_trampoline + TRAMPOLINE)
+
+# Long mode code
+.code64
+ap64:
+	# Set up segment registers
+	movw $0x10, %ax
+	movw %ax, %ds
+	movw %ax, %es
+	movw %ax, %fs
+	movw %ax, %gs
+	movw %ax, %ss
+
+	# Take the next processor number, and the stack set aside for it
+	movl $1, %eax
+	lock xaddl %eax, (smp_next - smp_trampoline + TRAMPOLINE)
+	cmpl $MAX_CPUS, %eax
+	jae 0f
+	movq (smp_stacks - smp_trampoline + TRAMPOLINE), %rbx
+	movq (%rbx, %rax, 8), %rsp
+
+	movq %rax, %rdi
+	movabsq $smp_ap_main, %rax
+	call *%rax
+
+0:	cli
+	hlt
+	jmp 0b
+
+.align 8
+.global smp_trampoline_data
+smp_trampoline_data:
+smp_cr3: .long 0
+smp_next: .long 0
+smp_stacks: .quad 0
+.global smp_trampoline_end
+smp_trampoline_end:
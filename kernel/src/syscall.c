@@ -2,7 +2,11 @@
 
 #include <system.h>
 
-#include "ata.h"
+#include "block.h"
+#include "cache.h"
+#include "cpu.h"
+#include "dentry.h"
+#include "keyboard.h"
 #include "memory.h"
 #include "panic.h"
 #include "proc.h"
@@ -26,40 +30,57 @@ static void _munmap(void* vaddr, u64 size) {
 	memory_free(memory_pm_get(), vaddr, size);
 }
 
-static void _disk_read(u64 block, void* buffer) {
-	ata_read_sector(ata_get_device(0), block, buffer);
+static void _disk_read(u64 block, void* buffer, u64 count) {
+	cache_read(block, count, buffer);
 }
 
-static void _disk_write(u64 block, void* buffer) {
-	ata_write_sector(ata_get_device(0), block, buffer);
+static void _disk_write(u64 block, void* buffer, u64 count) {
+	cache_write(block, count, buffer);
+}
+
+static void _disk_flush() {
+	block_sync();
+	cache_sync();
+}
+
+static void _disk_prefetch(u64 block, u64 count) {
+	cache_prefetch(block, count);
+}
+
+static void _disk_stats(struct disk_stats* stats) {
+	cache_stats(stats);
 }
 
 void (*syscall_handlers[]) = {
 	[SYS_YIELD] = proc_yield,
 	[SYS_EXIT] = proc_exit,
 	[SYS_EXEC] = proc_exec,
+	[SYS_FORK] = proc_fork,
 	[SYS_WAIT] = proc_wait,
+	[SYS_THREAD_CREATE] = proc_thread_create,
+	[SYS_THREAD_JOIN] = proc_thread_join,
 	[SYS_GETCWD] = proc_getcwd,
 	[SYS_CHDIR] = proc_chdir,
+	[SYS_CONSOLE_READ] = keyboard_read,
+	[SYS_CONSOLE_WRITE] = tty_output,
+	[SYS_INPUT_WAIT] = keyboard_wait,
 
 	[SYS_MMAP] = _mmap,
 	[SYS_MUNMAP] = _munmap,
 
 	[SYS_DISK_READ] = _disk_read,
 	[SYS_DISK_WRITE] = _disk_write,
-};
-
-static inline u64 rdmsr(u64 msr) {
-	u32 low, high;
-	asm volatile ("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
-	return ((u64) high << 32) | low;
-}
+	[SYS_DISK_FLUSH] = _disk_flush,
+	[SYS_DISK_PREFETCH] = _disk_prefetch,
+	[SYS_DISK_STATS] = _disk_stats,
+	[SYS_BLOCK_ALLOC] = block_alloc,
+	[SYS_BLOCK_FREE] = block_free,
+	[SYS_BLOCK_STATS] = block_stats,
 
-static inline void wrmsr(u64 msr, u64 data) {
-	u32 low = data & 0xFFFFFFFF;
-	u32 high = data >> 32;
-	asm volatile ("wrmsr" : : "c" (msr), "a" (low), "d" (high));
-}
+	[SYS_DENTRY_LOOKUP] = dentry_lookup,
+	[SYS_DENTRY_INSERT] = dentry_insert,
+	[SYS_DENTRY_INVALIDATE] = dentry_invalidate,
+};
 
 void syscall_init() {
 	wrmsr(0xC0000080, rdmsr(0xC0000080) | 1);
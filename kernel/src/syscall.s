@@ -1,11 +1,35 @@
 .global syscall_handler
 syscall_handler:
 	pushq %rcx
+
+	# Take the kernel lock, keeping the arguments
+	pushq %rax
+	pushq %rdi
+	pushq %rsi
+	pushq %rdx
+	pushq %r10
+	pushq %r8
+	pushq %r9
+	pushq %r9
+	call kernel_lock
+	popq %r9
+	popq %r9
+	popq %r8
+	popq %r10
+	popq %rdx
+	popq %rsi
+	popq %rdi
+	popq %rax
+
 	movq %r10, %rcx
-	movq $8, %rbx
-	mul %rbx
-	movabsq $syscall_handlers, %rbx
-	addq %rbx, %rax
-	call *(%rax)
+	movabsq $syscall_handlers, %r11
+	call *(%r11, %rax, 8)
+
+	pushq %rax
+	pushq %rax
+	call kernel_unlock
+	popq %rax
+	popq %rax
+
 	popq %rcx
 	jmp *%rcx
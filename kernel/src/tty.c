@@ -8,6 +8,7 @@
 
 #include "cpu.h"
 #include "memory.h"
+#include "smp.h"
 
 enum tty_ansi_state {
 	ANSI_ESC,
@@ -302,10 +303,31 @@ void tty_puts(const char* s) {
 	update_cursor();
 }
 
+// Queues output for tty_flush. Every processor prints, so the ring buffer
+// is only touched under the kernel lock, and with interrupts kept out so an
+// ISR printing can't interleave with the update
+u64 tty_output(const char* buffer, u64 length) {
+	kernel_lock();
+	u64 flags = interrupts_disable();
+	u64 written = stream_write(stdout, buffer, length);
+	interrupts_restore(flags);
+	kernel_unlock();
+	return written;
+}
+
+static u64 tty_drain(char* buffer, u64 length) {
+	kernel_lock();
+	u64 flags = interrupts_disable();
+	u64 read = stream_read(stdout, buffer, length);
+	interrupts_restore(flags);
+	kernel_unlock();
+	return read;
+}
+
 u64 tty_flush() {
 	char buffer[256];
 	u64 r, total = 0;
-	while ((r = stream_read(stdout, buffer, sizeof(buffer) - 1))) {
+	while ((r = tty_drain(buffer, sizeof(buffer) - 1))) {
 		buffer[r] = 0;
 		for (u64 i = 0; i < r; i++)
 			tty_write(buffer[i]);
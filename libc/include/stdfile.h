@@ -4,7 +4,10 @@
 #include "stdint.h"
 
 #define STD_FILE_NAME_LENGTH 460
+#define STD_FILE_SHORT_NAME_LENGTH 436
 #define STD_FILE_ROOT_BLOCK 2048
+#define STD_FILE_READAHEAD 32
+#define STD_FILE_INDEX_MIN 16
 
 #define STD_FILE_CREATE (1 << 0)
 #define STD_FILE_CLEAR (1 << 1)
@@ -22,7 +25,17 @@ typedef union std_file {
 		u64 size;
 		u64 time;
 		u32 type;
-		char name[STD_FILE_NAME_LENGTH];
+		union {
+			char name[STD_FILE_NAME_LENGTH];
+			// Directories with a short enough name can keep a hash index
+			// in the tail of it, which dir_magic marks
+			struct {
+				char short_name[STD_FILE_SHORT_NAME_LENGTH];
+				u64 dir_magic;
+				u64 dir_index;
+				u64 dir_generation;
+			} __attribute__ ((packed));
+		};
 	} __attribute__ ((packed));
 	struct {
 		u8 boot_code[486];
@@ -45,3 +58,4 @@ bool std_file_remove(std_file_t*);
 
 u64 std_file_write(std_file_t*, u64, const void*, u64);
 u64 std_file_read(std_file_t*, u64, void*, u64);
+u64 std_file_extents(std_file_t*);
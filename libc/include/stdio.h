@@ -26,6 +26,7 @@ int getkey();
 char getchar();
 void putchar(char);
 u64 puts(const char*);
+u64 putn(const char*, u64);
 u64 printf(const char*, ...);
 u64 vprintf(const char*, va_list);
 u64 vsnprintf(char*, u64, const char*, va_list);
@@ -11,3 +11,7 @@ char* realpath(const char*);
 
 _Noreturn void exit(u64);
 void yield();
+
+// Threads share everything but their stack, and are joined by tid
+u64 thread_create(u64 (*)(void*), void*);
+u64 thread_join(u64);
@@ -5,12 +5,32 @@
 
 enum syscall {
 	SYS_YIELD, SYS_EXIT,
-	SYS_EXEC, SYS_WAIT,
+	SYS_EXEC, SYS_FORK, SYS_WAIT,
+	SYS_THREAD_CREATE, SYS_THREAD_JOIN,
 	SYS_GETCWD, SYS_CHDIR,
+	SYS_CONSOLE_READ, SYS_CONSOLE_WRITE, SYS_INPUT_WAIT,
 
 	SYS_MMAP, SYS_MUNMAP,
 
-	SYS_DISK_READ, SYS_DISK_WRITE,
+	SYS_DISK_READ, SYS_DISK_WRITE, SYS_DISK_FLUSH,
+	SYS_DISK_PREFETCH, SYS_DISK_STATS,
+	SYS_BLOCK_ALLOC, SYS_BLOCK_FREE, SYS_BLOCK_STATS,
+	SYS_DENTRY_LOOKUP, SYS_DENTRY_INSERT, SYS_DENTRY_INVALIDATE,
+};
+
+// Block of a path cached as not existing
+#define DENTRY_NEGATIVE ((u64) -1)
+
+struct disk_stats {
+	u64 blocks, dirty;
+	u64 hits, misses;
+	u64 evictions, writebacks;
+	u64 prefetches;
+};
+
+struct block_stats {
+	u64 total, free;
+	u64 extents, largest;
 };
 
 u64 syscall(enum syscall, ...);
@@ -19,6 +39,10 @@ static inline u64 exec(char* path, char** argv) {
 	return syscall(SYS_EXEC, path, argv);
 }
 
+static inline u64 fork() {
+	return syscall(SYS_FORK);
+}
+
 static inline u64 wait(u64 pid) {
 	return syscall(SYS_WAIT, pid);
 }
@@ -31,6 +55,10 @@ static inline bool chdir(const char* path) {
 	return (bool) syscall(SYS_CHDIR, path);
 }
 
+static inline void input_wait() {
+	syscall(SYS_INPUT_WAIT);
+}
+
 static inline void* mmap(void* vaddr, u64 size) {
 	return (void*) syscall(SYS_MMAP, vaddr, size);
 }
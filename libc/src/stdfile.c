@@ -5,101 +5,386 @@
 #include "string.h"
 #include "system.h"
 
-static u64 total_blocks = 0;
-static u64 bitmap_offset = 0;
+static u64 alloc_blocks(u64 count, u64* allocated) {
+	return syscall(SYS_BLOCK_ALLOC, count, allocated);
+}
 
 static u64 alloc_block() {
-	u8 buffer[512];
-	if (total_blocks == 0) {
-		syscall(SYS_DISK_READ, 0, &buffer);
-		total_blocks = ((std_file_t*) &buffer)->total_blocks;
-		bitmap_offset = ((std_file_t*) &buffer)->bitmap_offset;
+	return alloc_blocks(1, NULL);
+}
+
+static void free_block(u64 index) {
+	syscall(SYS_BLOCK_FREE, index, 1);
+}
+
+// Pointer node blocks passed through by each open file, so seeking doesn't
+// have to walk the pointer[63] chain from the start. Files that didn't come
+// from std_file_open have none and always walk it
+static struct node_cache {
+	const std_file_t* file;
+	u64 child;
+	u64 count;
+	u64 capacity;
+	u64* nodes;
+	bool written; // committed once on close rather than on every write
+	struct node_cache* next;
+}* node_caches = NULL;
+
+static struct node_cache* node_cache_get(const std_file_t* file) {
+	for (struct node_cache* cache = node_caches; cache != NULL; cache = cache->next) {
+		if (cache->file != file)
+			continue;
+		// The nodes are only good for the chain they were found on
+		if (cache->child != file->child) {
+			cache->child = file->child;
+			cache->count = 0;
+		}
+		return cache;
+	}
+	return NULL;
+}
+
+static void node_cache_put(const std_file_t* file, u64 number, u64 index) {
+	struct node_cache* cache = node_cache_get(file);
+	if (cache == NULL)
+		return;
+	if (number < cache->count) {
+		cache->nodes[number] = index;
+		return;
+	}
+	if (number > cache->count)
+		return;
+	if (cache->count == cache->capacity) {
+		u64 capacity = cache->capacity ? cache->capacity * 2 : 16;
+		u64* nodes = realloc(cache->nodes, capacity * sizeof(u64));
+		if (nodes == NULL)
+			return;
+		cache->nodes = nodes;
+		cache->capacity = capacity;
 	}
-	u64 buffer_block = bitmap_offset;
-	for (u64 index = 0; index < total_blocks; index++) {
-		if (index % 4096 == 0)
-			syscall(SYS_DISK_READ, buffer_block++, &buffer);
-		u64 byte = (index % 4096) / 8;
-		if (index % 8 == 0 && buffer[byte] == 0xFF) {
-			index += 7;
+	cache->nodes[cache->count++] = index;
+}
+
+static void node_cache_open(const std_file_t* file) {
+	struct node_cache* cache = malloc(sizeof(struct node_cache));
+	if (cache == NULL)
+		return;
+	cache->file = file;
+	cache->child = file->child;
+	cache->count = 0;
+	cache->capacity = 0;
+	cache->nodes = NULL;
+	cache->written = false;
+	cache->next = node_caches;
+	node_caches = cache;
+}
+
+static void node_cache_close(const std_file_t* file) {
+	for (struct node_cache** cache = &node_caches; *cache != NULL; cache = &(*cache)->next) {
+		if ((*cache)->file != file)
 			continue;
+		struct node_cache* closed = *cache;
+		*cache = closed->next;
+		free(closed->nodes);
+		free(closed);
+		return;
+	}
+}
+
+// Read pointer node `number` of a file, growing the chain if `create` is set
+static u64 load_node(std_file_t* file, u64 number, std_file_t* node, bool create) {
+	u64 node_index = file->child;
+	u64 node_number = 0;
+	struct node_cache* cache = node_cache_get(file);
+	if (cache != NULL && cache->count > 0) {
+		node_number = number < cache->count ? number : cache->count - 1;
+		node_index = cache->nodes[node_number];
+	}
+	syscall(SYS_DISK_READ, node_index, node, 1);
+	node_cache_put(file, node_number, node_index);
+	while (node_number < number) {
+		if (node->pointer[63] == 0) {
+			if (!create)
+				return 0;
+			node->pointer[63] = alloc_block();
+			syscall(SYS_DISK_WRITE, node_index, node, 1);
+			node_index = node->pointer[63];
+			memset(node, 0, sizeof(*node));
+			syscall(SYS_DISK_WRITE, node_index, node, 1);
+		} else {
+			node_index = node->pointer[63];
+			syscall(SYS_DISK_READ, node_index, node, 1);
 		}
-		u64 mask = (1 << (7 - (index % 8)));
-		if (!(buffer[byte] & mask)) {
-			buffer[byte] |= mask;
-			syscall(SYS_DISK_WRITE, buffer_block - 1, &buffer);
-			return index;
+		node_cache_put(file, ++node_number, node_index);
+	}
+	return node_index;
+}
+
+#define DIR_MAGIC 0x5249444453465401
+#define DIR_INDEX_MAGIC 0x5844494453465401
+#define DIR_INDEX_BUCKETS 61
+#define DIR_BUCKET_ENTRIES 31
+
+// Optional hash index of a directory, pointed to by its dir_index field.
+// Anything that changes the entries of an indexed directory bumps its
+// dir_generation, and the index is only good for the generation it was last
+// updated at
+struct dir_index {
+	u64 magic;
+	u64 count;
+	u64 generation;
+	u64 bucket[DIR_INDEX_BUCKETS];
+};
+
+struct dir_bucket {
+	u64 count;
+	u64 next;
+	struct {
+		u64 hash;
+		u64 block;
+	} entry[DIR_BUCKET_ENTRIES];
+};
+
+static u64 hash_name(const char* name) {
+	u64 hash = 0xCBF29CE484222325;
+	for (; *name; name++)
+		hash = (hash ^ (u8) *name) * 0x100000001B3;
+	return hash;
+}
+
+// The fields after short_name are still part of the name on directories
+// that don't carry the magic, which includes every one on older images
+static bool dir_indexed(const std_file_t* dir) {
+	return dir->type == STD_DIRECTORY && dir->dir_magic == DIR_MAGIC;
+}
+
+static void dir_changed(std_file_t* dir) {
+	if (dir_indexed(dir))
+		dir->dir_generation++;
+}
+
+static bool disk_block_valid(u64 block) {
+	static u64 total_blocks = 0;
+	if (total_blocks == 0) {
+		std_file_t super;
+		syscall(SYS_DISK_READ, 0, &super, 1);
+		total_blocks = super.total_blocks;
+	}
+	return block != 0 && block < total_blocks;
+}
+
+static bool index_load(const std_file_t* dir, struct dir_index* index) {
+	if (!dir_indexed(dir) || !disk_block_valid(dir->dir_index))
+		return false;
+	syscall(SYS_DISK_READ, dir->dir_index, index, 1);
+	// Directories changed without bumping the generation fall back to the
+	// chain
+	return index->magic == DIR_INDEX_MAGIC && index->generation == dir->dir_generation
+		&& index->count == dir->size;
+}
+
+// Returns -1 if the directory has no usable index
+static int index_find(const std_file_t* dir, const char* name, std_file_t* out) {
+	struct dir_index index;
+	if (!index_load(dir, &index))
+		return -1;
+	u64 hash = hash_name(name);
+	struct dir_bucket bucket;
+	for (u64 block = index.bucket[hash % DIR_INDEX_BUCKETS]; block != 0; block = bucket.next) {
+		syscall(SYS_DISK_READ, block, &bucket, 1);
+		for (u64 i = 0; i < bucket.count; i++) {
+			if (bucket.entry[i].hash != hash)
+				continue;
+			std_file_t entry;
+			syscall(SYS_DISK_READ, bucket.entry[i].block, &entry, 1);
+			if (entry.parent == dir->index && !strcmp(entry.name, name)) {
+				if (out != NULL)
+					memcpy(out, &entry, sizeof(*out));
+				return 1;
+			}
 		}
 	}
 	return 0;
 }
 
-static void free_block(u64 index) {
-	u8 buffer[512];
-	if (bitmap_offset == 0) {
-		syscall(SYS_DISK_READ, 0, &buffer);
-		bitmap_offset = ((std_file_t*) &buffer)->bitmap_offset;
+static void index_insert(u64 index_block, struct dir_index* index, u64 hash, u64 entry) {
+	if (index->count == ~0ull)
+		return;
+	u64* head = &index->bucket[hash % DIR_INDEX_BUCKETS];
+	struct dir_bucket bucket;
+	u64 block = *head;
+	for (; block != 0; block = bucket.next) {
+		syscall(SYS_DISK_READ, block, &bucket, 1);
+		if (bucket.count < DIR_BUCKET_ENTRIES)
+			break;
+	}
+	if (block == 0) {
+		block = alloc_block();
+		if (block == 0) {
+			// Out of space, stop using the index until it is rebuilt
+			index->count = ~0ull;
+			syscall(SYS_DISK_WRITE, index_block, index, 1);
+			return;
+		}
+		memset(&bucket, 0, sizeof(bucket));
+		bucket.next = *head;
+		*head = block;
+	}
+	bucket.entry[bucket.count].hash = hash;
+	bucket.entry[bucket.count].block = entry;
+	bucket.count++;
+	syscall(SYS_DISK_WRITE, block, &bucket, 1);
+	index->count++;
+	syscall(SYS_DISK_WRITE, index_block, index, 1);
+}
+
+static void index_remove(const std_file_t* dir, u64 hash, u64 entry) {
+	struct dir_index index;
+	if (!index_load(dir, &index))
+		return;
+	struct dir_bucket bucket;
+	for (u64 block = index.bucket[hash % DIR_INDEX_BUCKETS]; block != 0; block = bucket.next) {
+		syscall(SYS_DISK_READ, block, &bucket, 1);
+		for (u64 i = 0; i < bucket.count; i++) {
+			if (bucket.entry[i].block != entry)
+				continue;
+			bucket.entry[i] = bucket.entry[--bucket.count];
+			syscall(SYS_DISK_WRITE, block, &bucket, 1);
+			index.count--;
+			index.generation++;
+			syscall(SYS_DISK_WRITE, dir->dir_index, &index, 1);
+			return;
+		}
+	}
+}
+
+static void index_free(std_file_t* dir) {
+	if (!dir_indexed(dir))
+		return;
+	struct dir_index index;
+	if (disk_block_valid(dir->dir_index)) {
+		syscall(SYS_DISK_READ, dir->dir_index, &index, 1);
+		if (index.magic == DIR_INDEX_MAGIC) {
+			for (int i = 0; i < DIR_INDEX_BUCKETS; i++) {
+				struct dir_bucket bucket;
+				for (u64 block = index.bucket[i]; block != 0; block = bucket.next) {
+					syscall(SYS_DISK_READ, block, &bucket, 1);
+					free_block(block);
+				}
+			}
+			free_block(dir->dir_index);
+		}
 	}
-	u64 block = bitmap_offset + (index / 4096);
-	syscall(SYS_DISK_READ, block, &buffer);
-	buffer[(index % 4096) / 8] &= ~(1 << (7 - (index % 8)));
-	syscall(SYS_DISK_WRITE, block, &buffer);
+	dir->dir_magic = 0;
+	dir->dir_index = 0;
+	dir->dir_generation = 0;
+}
+
+static void index_build(std_file_t* dir) {
+	index_free(dir);
+	if (strlen(dir->name) >= STD_FILE_SHORT_NAME_LENGTH)
+		return;
+	u64 index_block = alloc_block();
+	if (index_block == 0)
+		return;
+	struct dir_index index = { 0 };
+	index.magic = DIR_INDEX_MAGIC;
+	syscall(SYS_DISK_WRITE, index_block, &index, 1);
+	std_file_t entry;
+	for (u64 block = dir->child; block != 0; block = entry.next) {
+		syscall(SYS_DISK_READ, block, &entry, 1);
+		index_insert(index_block, &index, hash_name(entry.name), block);
+	}
+	dir->dir_magic = DIR_MAGIC;
+	dir->dir_index = index_block;
+	dir->dir_generation = 0;
 }
 
 static void clear_file(std_file_t* file) {
 	if (file->child == 0)
 		return;
 	std_file_t iter;
-	syscall(SYS_DISK_READ, file->child, &iter);
-	while (1) {
+	u64 node_index = file->child;
+	while (node_index != 0) {
+		syscall(SYS_DISK_READ, node_index, &iter, 1);
 		for (int i = 0; i < 63; i++)
 			if (iter.pointer[i] != 0)
 				free_block(iter.pointer[i]);
-		if (iter.pointer[63] == 0)
-			break;
-		syscall(SYS_DISK_READ, iter.pointer[63], &iter);
+		free_block(node_index);
+		node_index = iter.pointer[63];
 	}
+	file->child = 0;
 	file->size = 0;
+	syscall(SYS_DISK_WRITE, file->index, file, 1);
 }
 
 std_file_t* std_file_open(const char* path, u64 flags) {
 	char* rpath = realpath(path);
 	if (rpath == NULL)
 		return NULL;
-	path = rpath + 1;
 
 	std_file_t* block = malloc(sizeof(std_file_t));
-	block->index = STD_FILE_ROOT_BLOCK;
-	syscall(SYS_DISK_READ, block->index, block);
+	u64 length;
+	u64 index = syscall(SYS_DENTRY_LOOKUP, rpath, &length);
+	if (index == DENTRY_NEGATIVE) {
+		// Nothing can be created under a missing directory
+		if (rpath[length] != 0 || !(flags & STD_FILE_CREATE))
+			goto error;
+		// Otherwise walk from the closest cached directory above it
+		char* last = strrchr(rpath, '/');
+		*last = 0;
+		index = syscall(SYS_DENTRY_LOOKUP, rpath, &length);
+		*last = '/';
+		if (index == DENTRY_NEGATIVE)
+			goto error;
+	}
+	if (index != 0 && rpath[length] == 0) {
+		syscall(SYS_DISK_READ, index, block, 1);
+		goto found;
+	}
+
+	// Walk the rest of the path from the longest cached prefix, or the root
+	block->index = index != 0 ? index : STD_FILE_ROOT_BLOCK;
+	syscall(SYS_DISK_READ, block->index, block, 1);
 
 	char name[STD_FILE_NAME_LENGTH];
 	int name_index = 0;
-	for (; path[-1]; path++) {
-		name[name_index] = *path;
+	for (char* curr = rpath + length + 1; curr[-1]; curr++) {
+		name[name_index] = *curr;
 		if (name[name_index] == '/' || name[name_index] == 0) {
 			if (name_index == 0)
 				continue;
 			name[name_index] = 0;
 			if (block->type != STD_DIRECTORY)
 				goto error;
+			// Cut rpath at this component to remember the prefix
+			u64 parent = block->index;
+			char end = *curr;
+			*curr = 0;
 			if (!std_file_child(block, block, name)) {
-				if (*path != 0 || !(flags & STD_FILE_CREATE))
+				if (end != 0 || !(flags & STD_FILE_CREATE)) {
+					syscall(SYS_DENTRY_INSERT, rpath, parent, DENTRY_NEGATIVE);
 					goto error;
+				}
 				if (!std_file_add(block, STD_FILE, name))
 					goto error;
 				if (!std_file_child(block, block, name))
 					goto error;
 			}
+			syscall(SYS_DENTRY_INSERT, rpath, parent, block->index);
+			*curr = end;
 			name_index = 0;
 		} else {
 			name_index++;
 		}
 	}
 
-	if (flags & STD_FILE_CLEAR)
-		clear_file(block);
-
-	return block;
+	found:
+		free(rpath);
+		if (flags & STD_FILE_CLEAR)
+			clear_file(block);
+		node_cache_open(block);
+		return block;
 	error:
 		free(block);
 		free(rpath);
@@ -107,6 +392,10 @@ std_file_t* std_file_open(const char* path, u64 flags) {
 }
 
 void std_file_close(std_file_t* file) {
+	struct node_cache* cache = node_cache_get(file);
+	if (cache != NULL && cache->written)
+		syscall(SYS_DISK_FLUSH);
+	node_cache_close(file);
 	free(file);
 }
 
@@ -114,7 +403,7 @@ bool std_file_parent(std_file_t* file, std_file_t* out) {
 	if (file->parent == 0)
 		return false;
 	if (out != NULL)
-		syscall(SYS_DISK_READ, file->parent, out);
+		syscall(SYS_DISK_READ, file->parent, out, 1);
 	return true;
 }
 
@@ -123,11 +412,14 @@ bool std_file_child(std_file_t* file, std_file_t* out, const char* name) {
 		return false;
 	if (name == NULL) {
 		if (out != NULL)
-			syscall(SYS_DISK_READ, file->child, out);
+			syscall(SYS_DISK_READ, file->child, out, 1);
 		return true;
 	}
+	int found = index_find(file, name, out);
+	if (found >= 0)
+		return found;
 	std_file_t buffer;
-	syscall(SYS_DISK_READ, file->child, &buffer);
+	syscall(SYS_DISK_READ, file->child, &buffer, 1);
 	while (1) {
 		if (!strcmp(buffer.name, name)) {
 			if (out != NULL)
@@ -143,13 +435,15 @@ bool std_file_next(std_file_t* file, std_file_t* out) {
 	if (file->next == 0)
 		return false;
 	if (out != NULL)
-		syscall(SYS_DISK_READ, file->next, out);
+		syscall(SYS_DISK_READ, file->next, out, 1);
 	return true;
 }
 
-bool std_file_add(std_file_t* parent, enum std_file_type type, const char* name) {
+static bool add_entry(std_file_t* parent, enum std_file_type type, const char* name) {
 	if (parent->type != STD_DIRECTORY)
 		return false;
+	if (strlen(name) >= STD_FILE_NAME_LENGTH)
+		return false;
 	if (std_file_child(parent, NULL, name))
 		return false;
 
@@ -165,22 +459,45 @@ bool std_file_add(std_file_t* parent, enum std_file_type type, const char* name)
 	block.type = type;
 	strncpy(block.name, name, STD_FILE_NAME_LENGTH);
 
+	struct dir_index index;
+	bool indexed = index_load(parent, &index);
+	if (!indexed && parent->size >= STD_FILE_INDEX_MIN) {
+		index_build(parent);
+		indexed = index_load(parent, &index);
+	}
+	if (indexed) {
+		// Indexed directories aren't kept sorted, new entries go first
+		block.next = parent->child;
+		syscall(SYS_DISK_WRITE, block.index, &block, 1);
+		index.generation = ++parent->dir_generation;
+		index_insert(parent->dir_index, &index, hash_name(name), block.index);
+		parent->child = block.index;
+		parent->size++;
+		syscall(SYS_DISK_WRITE, parent->index, parent, 1);
+		syscall(SYS_DISK_FLUSH);
+		return true;
+	}
+
 	if (parent->child == 0) {
 		parent->child = block.index;
 		parent->size = 1;
-		syscall(SYS_DISK_WRITE, parent->index, parent);
-		syscall(SYS_DISK_WRITE, block.index, &block);
+		dir_changed(parent);
+		syscall(SYS_DISK_WRITE, parent->index, parent, 1);
+		syscall(SYS_DISK_WRITE, block.index, &block, 1);
+		syscall(SYS_DISK_FLUSH);
 		return true;
 	}
 
 	std_file_t curr;
-	syscall(SYS_DISK_READ, parent->child, &curr);
+	syscall(SYS_DISK_READ, parent->child, &curr, 1);
 	if (type >= curr.type && strcmp(name, curr.name) < 0) {
 		parent->child = block.index;
 		parent->size++;
-		syscall(SYS_DISK_WRITE, parent->index, parent);
+		dir_changed(parent);
+		syscall(SYS_DISK_WRITE, parent->index, parent, 1);
 		block.next = curr.index;
-		syscall(SYS_DISK_WRITE, block.index, &block);
+		syscall(SYS_DISK_WRITE, block.index, &block, 1);
+		syscall(SYS_DISK_FLUSH);
 		return true;
 	}
 	while (1) {
@@ -188,46 +505,65 @@ bool std_file_add(std_file_t* parent, enum std_file_type type, const char* name)
 		memcpy(&prev, &curr, sizeof(prev));
 		if (!std_file_next(&curr, &curr)) {
 			curr.next = block.index;
-			syscall(SYS_DISK_WRITE, curr.index, &curr);
+			syscall(SYS_DISK_WRITE, curr.index, &curr, 1);
 			parent->size++;
-			syscall(SYS_DISK_WRITE, parent->index, parent);
-			syscall(SYS_DISK_WRITE, block.index, &block);
+			dir_changed(parent);
+			syscall(SYS_DISK_WRITE, parent->index, parent, 1);
+			syscall(SYS_DISK_WRITE, block.index, &block, 1);
+			syscall(SYS_DISK_FLUSH);
 			return true;
 		}
 		if (type >= curr.type && strcmp(name, curr.name) < 0) {
 			prev.next = block.index;
-			syscall(SYS_DISK_WRITE, prev.index, &prev);
+			syscall(SYS_DISK_WRITE, prev.index, &prev, 1);
 			parent->size++;
-			syscall(SYS_DISK_WRITE, parent->index, parent);
+			dir_changed(parent);
+			syscall(SYS_DISK_WRITE, parent->index, parent, 1);
 			block.next = curr.index;
-			syscall(SYS_DISK_WRITE, block.index, &block);
+			syscall(SYS_DISK_WRITE, block.index, &block, 1);
+			syscall(SYS_DISK_FLUSH);
 			return true;
 		}
 	}
 }
 
+bool std_file_add(std_file_t* parent, enum std_file_type type, const char* name) {
+	if (!add_entry(parent, type, name))
+		return false;
+	syscall(SYS_DENTRY_INVALIDATE, parent->index, name);
+	return true;
+}
+
 bool std_file_remove(std_file_t* block) {
 	if (block->type == STD_DIRECTORY && block->size > 0)
 		return false;
 
 	clear_file(block);
+	if (block->type == STD_DIRECTORY)
+		index_free(block);
 
 	std_file_t iter;
 	if (!std_file_parent(block, &iter))
 		return false;
+	index_remove(&iter, hash_name(block->name), block->index);
 	iter.size--;
+	dir_changed(&iter);
 	if (iter.child == block->index) {
 		iter.child = block->next;
-		syscall(SYS_DISK_WRITE, iter.index, &iter);
+		syscall(SYS_DISK_WRITE, iter.index, &iter, 1);
 	} else {
-		syscall(SYS_DISK_WRITE, iter.index, &iter);
+		syscall(SYS_DISK_WRITE, iter.index, &iter, 1);
 		std_file_child(&iter, &iter, NULL);
 		while (iter.next != block->index)
 			std_file_next(&iter, &iter);
 		iter.next = block->next;
-		syscall(SYS_DISK_WRITE, iter.index, &iter);
+		syscall(SYS_DISK_WRITE, iter.index, &iter, 1);
 	}
 	free_block(block->index);
+	syscall(SYS_DISK_FLUSH);
+	syscall(SYS_DENTRY_INVALIDATE, block->parent, block->name);
+	if (block->type == STD_DIRECTORY)
+		syscall(SYS_DENTRY_INVALIDATE, block->index, NULL);
 	return true;
 }
 
@@ -242,38 +578,46 @@ u64 std_file_write(std_file_t* file, u64 offset, const void* buffer, u64 length)
 	std_file_t node = { 0 };
 	if (file->child == 0) {
 		file->child = alloc_block();
-		syscall(SYS_DISK_WRITE, file->index, file);
-		syscall(SYS_DISK_WRITE, file->child, &node);
-	} else {
-		syscall(SYS_DISK_READ, file->child, &node);
-	}
-	u64 node_index = file->child;
-	while (node_number--) {
-		if (node.pointer[63] == 0) {
-			node.pointer[63] = alloc_block();
-			syscall(SYS_DISK_WRITE, node_index, &node);
-			node_index = node.pointer[63];
-			memset(&node, 0, sizeof(node));
-			syscall(SYS_DISK_WRITE, node_index, &node);
-		} else {
-			node_index = node.pointer[63];
-			syscall(SYS_DISK_READ, node_index, &node);
-		}
+		syscall(SYS_DISK_WRITE, file->index, file, 1);
+		syscall(SYS_DISK_WRITE, file->child, &node, 1);
 	}
+	u64 node_index = load_node(file, node_number, &node, true);
+
+	// Data blocks reserved for the rest of the write, so that it stays
+	// contiguous across pointer nodes
+	u64 reserved = 0;
+	u64 reserved_count = 0;
 
 	u8* curr_buf = (u8*) buffer;
 	while (length) {
-		if (node.pointer[node_offset] == 0)
-			node.pointer[node_offset] = alloc_block();
+		if (node.pointer[node_offset] == 0) {
+			u64 blocks = (data_offset + length + 511) / 512;
+			if (reserved_count == 0) {
+				reserved = alloc_blocks(blocks, &reserved_count);
+				if (reserved == 0)
+					break;
+			}
+			for (u64 i = node_offset; i < 63 && i < node_offset + blocks
+					&& reserved_count > 0 && node.pointer[i] == 0; i++) {
+				node.pointer[i] = reserved++;
+				reserved_count--;
+			}
+		}
 		u64 to_write = length < (512 - data_offset) ? length : (512 - data_offset);
 
 		if (to_write == 512) {
-			syscall(SYS_DISK_WRITE, node.pointer[node_offset], curr_buf);
+			u64 count = 1;
+			while (node_offset + count < 63 && length >= 512 * (count + 1)
+					&& node.pointer[node_offset + count] == node.pointer[node_offset] + count)
+				count++;
+			syscall(SYS_DISK_WRITE, node.pointer[node_offset], curr_buf, count);
+			to_write = 512 * count;
+			node_offset += count - 1;
 		} else {
 			u8 data[512];
-			syscall(SYS_DISK_READ, node.pointer[node_offset], &data);
+			syscall(SYS_DISK_READ, node.pointer[node_offset], &data, 1);
 			memcpy(&data[data_offset], curr_buf, to_write);
-			syscall(SYS_DISK_WRITE, node.pointer[node_offset], &data);
+			syscall(SYS_DISK_WRITE, node.pointer[node_offset], &data, 1);
 			data_offset = 0;
 		}
 		curr_buf += to_write;
@@ -282,28 +626,49 @@ u64 std_file_write(std_file_t* file, u64 offset, const void* buffer, u64 length)
 		if (++node_offset == 63) {
 			if (node.pointer[node_offset] == 0) {
 				node.pointer[node_offset] = alloc_block();
-				syscall(SYS_DISK_WRITE, node_index, &node);
+				syscall(SYS_DISK_WRITE, node_index, &node, 1);
 				node_index = node.pointer[node_offset];
 				memset(&node, 0, sizeof(node));
-				syscall(SYS_DISK_WRITE, node_index, &node);
+				syscall(SYS_DISK_WRITE, node_index, &node, 1);
 			} else {
 				node_index = node.pointer[node_offset];
-				syscall(SYS_DISK_READ, node_index, &node);
+				syscall(SYS_DISK_READ, node_index, &node, 1);
 			}
+			node_cache_put(file, ++node_number, node_index);
 			node_offset = 0;
 		}
 	}
-	syscall(SYS_DISK_WRITE, node_index, &node);
+	syscall(SYS_DISK_WRITE, node_index, &node, 1);
+	if (reserved_count > 0)
+		syscall(SYS_BLOCK_FREE, reserved, reserved_count);
 
 	u64 written = (u64) curr_buf - (u64) buffer;
 	if (offset + written > file->size)
 		file->size = offset + written;
 	file->time = 0;
-	syscall(SYS_DISK_WRITE, file->index, file);
+	syscall(SYS_DISK_WRITE, file->index, file, 1);
+	struct node_cache* cache = node_cache_get(file);
+	if (cache != NULL)
+		cache->written = true;
+	else
+		syscall(SYS_DISK_FLUSH);
 	return written;
 }
 
+static void prefetch_blocks(const std_file_t* node, u64 first, u64 count) {
+	for (u64 i = first; i < first + count && node->pointer[i] != 0;) {
+		u64 run = 1;
+		while (i + run < first + count && node->pointer[i + run] == node->pointer[i] + run)
+			run++;
+		syscall(SYS_DISK_PREFETCH, node->pointer[i], run);
+		i += run;
+	}
+}
+
 u64 std_file_read(std_file_t* file, u64 offset, void* buffer, u64 length) {
+	static u64 last_index = 0;
+	static u64 last_offset = 0;
+
 	if (file->type != STD_FILE)
 		return 0;
 	if (file->child == 0)
@@ -311,31 +676,33 @@ u64 std_file_read(std_file_t* file, u64 offset, void* buffer, u64 length) {
 	if (length == 0)
 		return 0;
 
+	bool sequential = file->index == last_index && offset == last_offset;
 	u64 data_offset = (offset & 0x1FF);
 	u64 node_offset = (offset >> 9) % 63;
 	u64 node_number = (offset >> 9) / 63;
 
 	std_file_t node = { 0 };
-	syscall(SYS_DISK_READ, file->child, &node);
-	u64 node_index = file->child;
-	while (node_number--) {
-		if (node.pointer[63] == 0)
-			return 0;
-		node_index = node.pointer[63];
-		syscall(SYS_DISK_READ, node_index, &node);
-	}
+	u64 node_index = load_node(file, node_number, &node, false);
+	if (node_index == 0)
+		return 0;
 
 	u8* curr_buf = (u8*) buffer;
 	while (length) {
 		if (node.pointer[node_offset] == 0)
-			return curr_buf - (u8*) buffer;
+			break;
 		u64 to_read = length < (512 - data_offset) ? length : (512 - data_offset);
 
 		if (to_read == 512) {
-			syscall(SYS_DISK_READ, node.pointer[node_offset], curr_buf);
+			u64 count = 1;
+			while (node_offset + count < 63 && length >= 512 * (count + 1)
+					&& node.pointer[node_offset + count] == node.pointer[node_offset] + count)
+				count++;
+			syscall(SYS_DISK_READ, node.pointer[node_offset], curr_buf, count);
+			to_read = 512 * count;
+			node_offset += count - 1;
 		} else {
 			u8 data[512];
-			syscall(SYS_DISK_READ, node.pointer[node_offset], &data);
+			syscall(SYS_DISK_READ, node.pointer[node_offset], &data, 1);
 			memcpy(curr_buf, &data[data_offset], to_read);
 			data_offset = 0;
 		}
@@ -344,12 +711,42 @@ u64 std_file_read(std_file_t* file, u64 offset, void* buffer, u64 length) {
 
 		if (++node_offset == 63) {
 			if (node.pointer[63] == 0)
-				return curr_buf - (u8*) buffer;
+				break;
 			node_index = node.pointer[63];
-			syscall(SYS_DISK_READ, node_index, &node);
+			syscall(SYS_DISK_READ, node_index, &node, 1);
+			node_cache_put(file, ++node_number, node_index);
 			node_offset = 0;
 		}
 	}
 
-	return curr_buf - (u8*) buffer;
+	// Read ahead the next blocks (and the next node) on sequential access
+	u64 read = curr_buf - (u8*) buffer;
+	if (sequential && node_offset < 63) {
+		u64 count = 63 - node_offset < STD_FILE_READAHEAD ? 63 - node_offset : STD_FILE_READAHEAD;
+		prefetch_blocks(&node, node_offset, count);
+		if (node_offset + count == 63 && node.pointer[63] != 0)
+			syscall(SYS_DISK_PREFETCH, node.pointer[63], 1);
+	}
+	last_index = file->index;
+	last_offset = offset + read;
+	return read;
+}
+
+u64 std_file_extents(std_file_t* file) {
+	if (file->type != STD_FILE || file->child == 0)
+		return 0;
+	u64 extents = 0;
+	u64 last = 0;
+	std_file_t node;
+	u64 node_index = file->child;
+	while (node_index != 0) {
+		syscall(SYS_DISK_READ, node_index, &node, 1);
+		for (int i = 0; i < 63 && node.pointer[i] != 0; i++) {
+			if (node.pointer[i] != last + 1)
+				extents++;
+			last = node.pointer[i];
+		}
+		node_index = node.pointer[63];
+	}
+	return extents;
 }
@@ -11,13 +11,19 @@
 struct stream* stdin = NULL;
 struct stream* stdout = NULL;
 
+// The console streams are shared by every process, so only the kernel
+// touches them
+static u64 console_read(char* c) {
+	return syscall(SYS_CONSOLE_READ, c, 1);
+}
+
 int getkey() {
 	char c;
-	while (stream_read(stdin, &c, 1) == 0)
-		yield();
+	while (console_read(&c) == 0)
+		input_wait();
 	if (c != KEY_SEQ)
 		return (int) c;
-	if (stream_read(stdin, &c, 1) == 0)
+	if (console_read(&c) == 0)
 		return KEY_SEQ;
 	return KEY_ESC + c;
 }
@@ -25,22 +31,24 @@ int getkey() {
 char getchar() {
 	while (1) {
 		char c;
-		while (stream_read(stdin, &c, 1) == 0)
-			yield();
+		while (console_read(&c) == 0)
+			input_wait();
 		if (c != KEY_SEQ)
 			return c;
-		stream_read(stdin, &c, 1);
+		console_read(&c);
 	}
 }
 
 void putchar(char c) {
-	stream_write(stdout, &c, 1);
+	putn(&c, 1);
 }
 
 u64 puts(const char* s) {
-	u64 len = strlen(s);
-	stream_write(stdout, s, len);
-	return len;
+	return putn(s, strlen(s));
+}
+
+u64 putn(const char* s, u64 len) {
+	return syscall(SYS_CONSOLE_WRITE, s, len);
 }
 
 static char* itoa(u64 i, int base, int pad, char padchar) {
@@ -8,73 +8,384 @@
 #include "system.h"
 
 #define HEAP_MAGIC 0xDEADBEEFFEEBDAED
+#define HEAP_MAPPED_MAGIC 0xDEADBEEFFEEBDA7A
 #define HEAP_PAGES 16
+#define HEAP_HUGE_PAGES 512
+#define HEAP_MAPPED_PAGES 64
+#define HEAP_BINS 64
+#define HEAP_SLAB_MAGIC 0x51AB51AB51AB51AB
+#define HEAP_SLAB_PAGES 16
+#define HEAP_SLAB_SIZE (HEAP_SLAB_PAGES * 0x1000)
+#define HEAP_SLAB_BUCKETS 64
 
+// Blocks too big for a slab, kept in address order across the arenas
 static struct heap_node {
 	u64 magic;
 	u64 size : 63;
 	u64 free :  1;
 	struct heap_node* prev;
 	struct heap_node* next;
-} __attribute__ ((packed)) *heap_head;
+} __attribute__ ((packed)) *heap_head, *heap_tail;
+
+// Free blocks are also linked into a bin by the log2 of their size, through
+// the start of their payload
+struct heap_link {
+	struct heap_node* prev;
+	struct heap_node* next;
+};
+
+static struct heap_node* heap_bins[HEAP_BINS];
+static u64 heap_bin_mask;
+
+// Arenas double in size as the heap grows, up to a huge page
+static u64 heap_arena_pages = HEAP_PAGES;
+
+// Small objects come from slabs of a single size, aligned to their size so
+// an object finds its slab by masking its address
+struct heap_slab {
+	u64 magic;
+	struct heap_class* class;
+	u64 used;
+	u64 top;
+	void* free;
+	struct heap_slab* prev;
+	struct heap_slab* next;
+	struct heap_slab* hash;
+};
+
+static struct heap_class {
+	u64 size;
+	struct heap_slab* partial;
+} heap_classes[] = {
+	{ .size = 16 }, { .size = 32 }, { .size = 48 }, { .size = 64 },
+	{ .size = 96 }, { .size = 128 }, { .size = 192 }, { .size = 256 },
+	{ .size = 384 }, { .size = 512 }, { .size = 768 }, { .size = 1024 },
+	{ .size = 1536 }, { .size = 2048 },
+};
+
+#define HEAP_CLASSES (sizeof(heap_classes) / sizeof(heap_classes[0]))
+#define HEAP_SLAB_START ((sizeof(struct heap_slab) + 15) & ~15ull)
+
+static struct heap_slab* heap_slabs[HEAP_SLAB_BUCKETS];
+
+// Threads of a program share its heap. The kernel holds its own lock
+// whenever it allocates, so it never finds this one taken
+static volatile u32 heap_lock;
+
+static void heap_acquire() {
+	while (__atomic_exchange_n(&heap_lock, 1, __ATOMIC_ACQUIRE))
+		syscall(SYS_YIELD);
+}
+
+static void heap_release() {
+	__atomic_store_n(&heap_lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct heap_link* bin_link(struct heap_node* node) {
+	return (struct heap_link*) (node + 1);
+}
+
+static u64 bin_of(u64 size) {
+	return 63 - __builtin_clzll(size);
+}
+
+static void bin_insert(struct heap_node* node) {
+	u64 bin = bin_of(node->size);
+	bin_link(node)->prev = NULL;
+	bin_link(node)->next = heap_bins[bin];
+	if (heap_bins[bin] != NULL)
+		bin_link(heap_bins[bin])->prev = node;
+	heap_bins[bin] = node;
+	heap_bin_mask |= 1ull << bin;
+}
+
+static void bin_remove(struct heap_node* node) {
+	u64 bin = bin_of(node->size);
+	struct heap_link* link = bin_link(node);
+	if (link->prev != NULL)
+		bin_link(link->prev)->next = link->next;
+	else
+		heap_bins[bin] = link->next;
+	if (link->next != NULL)
+		bin_link(link->next)->prev = link->prev;
+	if (heap_bins[bin] == NULL)
+		heap_bin_mask &= ~(1ull << bin);
+}
+
+static u64 mapping_pages(u64 size) {
+	u64 pages = (size + sizeof(struct heap_node) + 0xFFF) / 0x1000;
+	// Round big mappings up to whole huge pages
+	if (pages >= HEAP_HUGE_PAGES)
+		pages = (pages + HEAP_HUGE_PAGES - 1) / HEAP_HUGE_PAGES * HEAP_HUGE_PAGES;
+	return pages;
+}
+
+static struct heap_node* arena_new(u64 size) {
+	u64 pages = mapping_pages(size);
+	if (pages < heap_arena_pages)
+		pages = heap_arena_pages;
+	if (heap_arena_pages < HEAP_HUGE_PAGES)
+		heap_arena_pages *= 2;
+	struct heap_node* node = mmap(NULL, pages);
+	node->magic = HEAP_MAGIC;
+	node->size = 0x1000 * pages - sizeof(struct heap_node);
+	node->free = true;
+	node->prev = heap_tail;
+	node->next = NULL;
+	if (heap_tail != NULL)
+		heap_tail->next = node;
+	else
+		heap_head = node;
+	heap_tail = node;
+	bin_insert(node);
+	return node;
+}
 
 void _libc_init_heap() {
-	heap_head = mmap(NULL, HEAP_PAGES);
-	heap_head->magic = HEAP_MAGIC;
-	heap_head->size = 0x1000 * HEAP_PAGES - sizeof(struct heap_node);
-	heap_head->free = true;
-	heap_head->prev = NULL;
-	heap_head->next = NULL;
+	arena_new(0);
 }
 
 static bool can_concat(struct heap_node* node) {
 	return ((u64) node->next) == ((u64) node) + node->size + sizeof(*node);
 }
 
-void* malloc(u64 size) {
+// Hand a free block spanning a whole arena back, unless it is the last one
+static bool arena_release(struct heap_node* node) {
+	if ((node->prev != NULL && can_concat(node->prev)) || (node->next != NULL && can_concat(node)))
+		return false;
+	if (node->prev == NULL && node->next == NULL)
+		return false;
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		heap_head = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	else
+		heap_tail = node->prev;
+	node->magic = 0;
+	munmap(node, (node->size + sizeof(struct heap_node)) / 0x1000);
+	return true;
+}
+
+// Cut a used or free block down to size, the rest becomes a free block
+static void node_split(struct heap_node* node, u64 size) {
+	if (node->size < size + sizeof(struct heap_node) + sizeof(struct heap_link))
+		return;
+	struct heap_node* next = (struct heap_node*) ((u64) node + sizeof(struct heap_node) + size);
+	next->magic = HEAP_MAGIC;
+	next->size = node->size - sizeof(struct heap_node) - size;
+	next->free = true;
+	next->prev = node;
+	next->next = node->next;
+	if (next->next != NULL)
+		next->next->prev = next;
+	else
+		heap_tail = next;
+	node->size = size;
+	node->next = next;
+	bin_insert(next);
+}
+
+// Absorb the free block following node, which must be out of its bin
+static void node_absorb(struct heap_node* node) {
+	struct heap_node* next = node->next;
+	assert(next->magic == HEAP_MAGIC);
+	next->magic = 0;
+	node->size += sizeof(struct heap_node) + next->size;
+	node->next = next->next;
+	if (node->next != NULL)
+		node->next->prev = node;
+	else
+		heap_tail = node;
+}
+
+// Very large blocks get a mapping of their own, which goes away on free
+static void* mapped_alloc(u64 size) {
+	struct heap_node* node = mmap(NULL, mapping_pages(size));
+	node->magic = HEAP_MAPPED_MAGIC;
+	node->size = size;
+	node->free = false;
+	node->prev = NULL;
+	node->next = NULL;
+	return node + 1;
+}
+
+static void mapped_free(struct heap_node* node) {
+	node->magic = 0;
+	munmap(node, mapping_pages(node->size));
+}
+
+static void* node_alloc(u64 size) {
+	size = (size + 15) & ~15ull;
 	while (1) {
-		struct heap_node* node = heap_head;
-		while (1) {
-			assert(node->magic == HEAP_MAGIC);
-			if (node->free) {
-				u64 addr = (u64) node + sizeof(struct heap_node);
-				if (node->size == size) {
-					node->free = false;
-					return (void*) addr;
-				} else if (node->size > size + sizeof(struct heap_node)) {
-					struct heap_node* next = (struct heap_node*) (addr + size);
-					next->magic = HEAP_MAGIC;
-					next->size = node->size - sizeof(struct heap_node) - size;
-					next->free = true;
-					next->prev = node;
-					next->next = node->next;
-					if (next->next != NULL)
-						next->next->prev = next;
-
-					node->size = size;
-					node->free = false;
-					node->next = next;
-					return (void*) addr;
-				}
-			}
-			if (node->next == NULL)
-				break;
-			node = node->next;
+		// The first block of the size's own bin may still be too small, any
+		// block of a higher bin fits
+		u64 bin = bin_of(size);
+		for (struct heap_node* node = heap_bins[bin]; node != NULL; node = bin_link(node)->next) {
+			if (node->size < size)
+				continue;
+			bin_remove(node);
+			node->free = false;
+			node_split(node, size);
+			return node + 1;
+		}
+		u64 mask = heap_bin_mask & ~((2ull << bin) - 1);
+		if (mask != 0) {
+			struct heap_node* node = heap_bins[__builtin_ctzll(mask)];
+			bin_remove(node);
+			node->free = false;
+			node_split(node, size);
+			return node + 1;
 		}
 
-		u64 pages = HEAP_PAGES;
-		while (pages * 0x1000 < size)
-			pages += HEAP_PAGES;
-		node->next = mmap(NULL, pages);
-		printf("new heap at %x (from %x)\n", node->next, heap_head);
-		node->next->magic = HEAP_MAGIC;
-		node->next->size = 0x1000 * pages - sizeof(struct heap_node);
-		node->next->free = true;
-		node->next->prev = node;
-		node->next->next = NULL;
+		arena_new(size);
 	}
 }
 
+static void node_free(struct heap_node* node) {
+	assert(node->magic == HEAP_MAGIC);
+	node->free = true;
+	if (node->next != NULL && node->next->free && can_concat(node)) {
+		bin_remove(node->next);
+		node_absorb(node);
+	}
+	if (node->prev != NULL && node->prev->free && can_concat(node->prev)) {
+		node = node->prev;
+		bin_remove(node);
+		node_absorb(node);
+	}
+	if (!arena_release(node))
+		bin_insert(node);
+}
+
+static struct heap_slab* slab_of(void* addr) {
+	u64 base = (u64) addr & ~(HEAP_SLAB_SIZE - 1ull);
+	struct heap_slab* slab = heap_slabs[(base / HEAP_SLAB_SIZE) % HEAP_SLAB_BUCKETS];
+	while (slab != NULL && (u64) slab != base)
+		slab = slab->hash;
+	return slab;
+}
+
+static struct heap_slab* slab_new(struct heap_class* class) {
+	// Map twice the size and trim it to an aligned slab
+	u64 area = (u64) mmap(NULL, HEAP_SLAB_PAGES * 2);
+	u64 base = (area + HEAP_SLAB_SIZE - 1) & ~(HEAP_SLAB_SIZE - 1ull);
+	if (base > area)
+		munmap((void*) area, (base - area) / 0x1000);
+	munmap((void*) (base + HEAP_SLAB_SIZE), (area + HEAP_SLAB_SIZE - base) / 0x1000);
+
+	struct heap_slab* slab = (void*) base;
+	slab->magic = HEAP_SLAB_MAGIC;
+	slab->class = class;
+	slab->used = 0;
+	slab->top = HEAP_SLAB_START;
+	slab->free = NULL;
+	slab->prev = NULL;
+	slab->next = NULL;
+	struct heap_slab** bucket = &heap_slabs[(base / HEAP_SLAB_SIZE) % HEAP_SLAB_BUCKETS];
+	slab->hash = *bucket;
+	*bucket = slab;
+	return slab;
+}
+
+static void slab_unlink(struct heap_slab* slab) {
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		slab->class->partial = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+static void slab_link(struct heap_slab* slab) {
+	slab->prev = NULL;
+	slab->next = slab->class->partial;
+	if (slab->next != NULL)
+		slab->next->prev = slab;
+	slab->class->partial = slab;
+}
+
+static bool slab_full(struct heap_slab* slab) {
+	return slab->free == NULL && slab->top + slab->class->size > HEAP_SLAB_SIZE;
+}
+
+static void* slab_alloc(struct heap_class* class) {
+	struct heap_slab* slab = class->partial;
+	if (slab == NULL) {
+		slab = slab_new(class);
+		slab_link(slab);
+	}
+	void* addr;
+	// Objects that were never handed out are carved off the top, so a fresh
+	// slab doesn't touch all of its pages up front
+	if (slab->free != NULL) {
+		addr = slab->free;
+		slab->free = *(void**) addr;
+	} else {
+		addr = (void*) slab + slab->top;
+		slab->top += class->size;
+	}
+	slab->used++;
+	if (slab_full(slab))
+		slab_unlink(slab);
+	return addr;
+}
+
+static void slab_release(struct heap_slab* slab) {
+	slab_unlink(slab);
+	struct heap_slab** bucket = &heap_slabs[((u64) slab / HEAP_SLAB_SIZE) % HEAP_SLAB_BUCKETS];
+	while (*bucket != slab)
+		bucket = &(*bucket)->hash;
+	*bucket = slab->hash;
+	slab->magic = 0;
+	munmap(slab, HEAP_SLAB_PAGES);
+}
+
+static void slab_free(struct heap_slab* slab, void* addr) {
+	assert(slab->magic == HEAP_SLAB_MAGIC);
+	if (slab_full(slab))
+		slab_link(slab);
+	*(void**) addr = slab->free;
+	slab->free = addr;
+	slab->used--;
+	// Keep one slab around per class so a single object going back and
+	// forth doesn't map and unmap every time
+	if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL))
+		slab_release(slab);
+}
+
+static void* heap_alloc(u64 size) {
+	for (u64 i = 0; i < HEAP_CLASSES; i++)
+		if (size <= heap_classes[i].size)
+			return slab_alloc(&heap_classes[i]);
+	if (size >= HEAP_MAPPED_PAGES * 0x1000)
+		return mapped_alloc(size);
+	return node_alloc(size);
+}
+
+static void heap_free(void* addr) {
+	if (addr == NULL)
+		return;
+	struct heap_slab* slab = slab_of(addr);
+	struct heap_node* node = (struct heap_node*) addr - 1;
+	if (slab != NULL)
+		slab_free(slab, addr);
+	else if (node->magic == HEAP_MAPPED_MAGIC)
+		mapped_free(node);
+	else
+		node_free(node);
+}
+
+void* malloc(u64 size) {
+	heap_acquire();
+	void* addr = heap_alloc(size);
+	heap_release();
+	return addr;
+}
+
 void* calloc(u64 size) {
 	void* data = malloc(size);
 	if (data != NULL)
@@ -82,67 +393,56 @@ void* calloc(u64 size) {
 	return data;
 }
 
-void* realloc(void* addr, u64 size) {
+static void* heap_realloc(void* addr, u64 size) {
 	if (addr == NULL)
-		return malloc(size);
-	struct heap_node* node = (void*) (addr - sizeof(struct heap_node));
-	assert(node->magic == HEAP_MAGIC);
-	i64 size_diff = size - node->size;
-	if (size_diff <= 0)
-		return addr;
-	if (node->next != NULL && node->next->free && can_concat(node)) {
-		struct heap_node* next = node->next;
-		assert(next->magic == HEAP_MAGIC);
-		if (next->size == size_diff - sizeof(struct heap_node)) {
-			next->magic = 0;
-			node->size += sizeof(struct heap_node) + next->size;
-			if (next->next != NULL) {
-				assert(next->next->magic == HEAP_MAGIC);
-				next->next->prev = node;
-			}
-			node->next = next->next;
+		return heap_alloc(size);
+	u64 old_size;
+	struct heap_slab* slab = slab_of(addr);
+	if (slab != NULL) {
+		old_size = slab->class->size;
+		if (size <= old_size)
+			return addr;
+	} else if (((struct heap_node*) addr - 1)->magic == HEAP_MAPPED_MAGIC) {
+		struct heap_node* node = (struct heap_node*) addr - 1;
+		old_size = node->size;
+		if (mapping_pages(size) == mapping_pages(old_size)) {
+			node->size = size;
+			return addr;
+		}
+	} else {
+		struct heap_node* node = (void*) (addr - sizeof(struct heap_node));
+		assert(node->magic == HEAP_MAGIC);
+		old_size = node->size;
+		if (size <= old_size)
 			return addr;
-		} else if (next->size > size_diff) {
-			next->magic = 0;
-			next = (struct heap_node*) (addr + size);
-			memmove(next, node->next, sizeof(struct heap_node));
-			next->magic = HEAP_MAGIC;
-			next->size -= size_diff;
-			node->size += size_diff;
-			node->next = next;
+		u64 grown = (size + 15) & ~15ull;
+		if (node->next != NULL && node->next->free && can_concat(node)
+				&& node->size + sizeof(struct heap_node) + node->next->size >= grown) {
+			bin_remove(node->next);
+			node_absorb(node);
+			node_split(node, grown);
 			return addr;
 		}
 	}
-	void* new_addr = malloc(size);
+	void* new_addr = heap_alloc(size);
 	if (new_addr == NULL)
 		return NULL;
-	memcpy(new_addr, addr, node->size);
-	free(addr);
+	memcpy(new_addr, addr, old_size < size ? old_size : size);
+	heap_free(addr);
+	return new_addr;
+}
+
+void* realloc(void* addr, u64 size) {
+	heap_acquire();
+	void* new_addr = heap_realloc(addr, size);
+	heap_release();
 	return new_addr;
 }
 
 void free(void* addr) {
-	struct heap_node* node = (void*) (addr - sizeof(struct heap_node));
-	assert(node->magic == HEAP_MAGIC);
-	node->free = true;
-	if (node->next != NULL && node->next->free && can_concat(node)) {
-		node->next->magic = 0;
-		node->size += sizeof(struct heap_node) + node->next->size;
-		if (node->next->next != NULL) {
-			assert(node->next->next->magic == HEAP_MAGIC);
-			node->next->next->prev = node;
-		}
-		node->next = node->next->next;
-	}
-	if (node->prev != NULL && node->prev->free && can_concat(node->prev)) {
-		node->magic = 0;
-		node->prev->size += sizeof(struct heap_node) + node->size;
-		if (node->next != NULL) {
-			assert(node->next->magic == HEAP_MAGIC);
-			node->next->prev = node->prev;
-		}
-		node->prev->next = node->next;
-	}
+	heap_acquire();
+	heap_free(addr);
+	heap_release();
 }
 
 char* realpath(const char* path) {
@@ -206,3 +506,15 @@ void yield() {
 _Noreturn void exit(u64 ret) {
 	while (1) syscall(SYS_EXIT, ret);
 }
+
+static _Noreturn void thread_start(u64 (*func)(void*), void* arg) {
+	exit(func(arg));
+}
+
+u64 thread_create(u64 (*func)(void*), void* arg) {
+	return syscall(SYS_THREAD_CREATE, thread_start, func, arg);
+}
+
+u64 thread_join(u64 tid) {
+	return syscall(SYS_THREAD_JOIN, tid);
+}
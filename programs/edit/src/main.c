@@ -101,7 +101,7 @@ void screen_draw(int y) {
 			putchar(s[i]);
 		}
 	} else {
-		stream_write(stdout, &row->render[col_off], n);
+		putn(&row->render[col_off], n);
 	}
 }
 
@@ -1,31 +1,14 @@
 #include <stddef.h>
-#include <stdfile.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <system.h>
 
 int main() {
-	std_file_t super;
-	syscall(SYS_DISK_READ, 0, &super);
-
-	u64 total_size = super.total_blocks * 512;
-	u8* bitmap = (u8*) &super;
-	u64 bitmap_blocks = super.bitmap_blocks;
-	u64 bitmap_offset = super.bitmap_offset;
-	u64 used_size = 0;
-	for (u64 block = 0; block < bitmap_blocks; block++) {
-		syscall(SYS_DISK_READ, bitmap_offset + block, bitmap);
-		for (int i = 0; i < 512; i++) {
-			if (bitmap[i] == 0xFF) {
-				used_size += 512 * 8;
-			} else for (int j = 0; j < 8; j++) {
-				if (bitmap[i] & (1 << j)) {
-					used_size += 512;
-				}
-			}
-		}
-	}
+	struct block_stats blocks;
+	syscall(SYS_BLOCK_STATS, &blocks);
 
+	u64 total_size = blocks.total * 512;
+	u64 used_size = (blocks.total - blocks.free) * 512;
 	u64 percent_used = (100 * used_size) / total_size;
 
 	char total_unit = 'B';
@@ -41,5 +24,14 @@ int main() {
 	printf("Disk usage: %d%c of %d%c (%d%%)\n",
 		used_size, used_unit, total_size, total_unit, percent_used
 	);
+	printf("Free space: %d extents, largest %dK\n",
+		blocks.extents, blocks.largest / 2
+	);
+
+	struct disk_stats stats;
+	syscall(SYS_DISK_STATS, &stats);
+	printf("Disk cache: %d blocks (%d dirty), %d hits, %d misses, %d evictions, %d writebacks, %d prefetches\n",
+		stats.blocks, stats.dirty, stats.hits, stats.misses, stats.evictions, stats.writebacks, stats.prefetches
+	);
 	return 0;
 }
@@ -1,11 +1,52 @@
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdfile.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <system.h>
 
+struct entry {
+	u32 type;
+	u64 size;
+	u64 extents;
+	char* name;
+};
+
+static bool entry_before(const struct entry* a, const struct entry* b) {
+	if (a->type != b->type)
+		return a->type == STD_DIRECTORY;
+	return strcmp(a->name, b->name) < 0;
+}
+
+// Merge sort, runs of doubling width alternate between the two arrays.
+// Returns the one that ends up sorted
+static struct entry* sort_entries(struct entry* entries, struct entry* scratch, u64 count) {
+	for (u64 width = 1; width < count; width *= 2) {
+		for (u64 lo = 0; lo < count; lo += 2 * width) {
+			u64 mid = lo + width < count ? lo + width : count;
+			u64 hi = lo + 2 * width < count ? lo + 2 * width : count;
+			u64 i = lo, j = mid, k = lo;
+			while (i < mid && j < hi)
+				scratch[k++] = entry_before(&entries[j], &entries[i]) ? entries[j++] : entries[i++];
+			while (i < mid)
+				scratch[k++] = entries[i++];
+			while (j < hi)
+				scratch[k++] = entries[j++];
+		}
+		struct entry* tmp = entries;
+		entries = scratch;
+		scratch = tmp;
+	}
+	return entries;
+}
+
 int main(int argc, char** argv) {
-	char* path = argc > 1 ? realpath(argv[1]) : getcwd(NULL);
+	// -l also counts the extents of each file, which reads all of its
+	// pointer nodes
+	bool extents = argc > 1 && !strcmp(argv[1], "-l");
+	const char* name = argc > 1 + extents ? argv[1 + extents] : NULL;
+	char* path = name != NULL ? realpath(name) : getcwd(NULL);
 	if (path == NULL) {
 		printf("%s: Invalid path\n", argv[0]);
 		return 1;
@@ -14,11 +55,11 @@ int main(int argc, char** argv) {
 	std_file_t* file = std_file_open(path, 0);
 	free(path);
 	if (file == NULL) {
-		printf("%s: %s: No such file or directory\n", argv[0], argv[1]);
+		printf("%s: %s: No such file or directory\n", argv[0], name);
 		return 2;
 	}
 	if (file->type != STD_DIRECTORY) {
-		printf("%s: %s: Not a directory\n", argv[0], argv[1]);
+		printf("%s: %s: Not a directory\n", argv[0], name);
 		std_file_close(file);
 		return 3;
 	}
@@ -28,11 +69,30 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+	// Indexed directories aren't kept in order, so sort the listing here
+	struct entry* entries = NULL;
+	u64 count = 0;
+	u64 capacity = 0;
 	do {
-		if (file->type == STD_DIRECTORY) {
-			printf("%7d  \033[94m%s\033[0m\n", file->size, file->name);
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			entries = realloc(entries, capacity * sizeof(struct entry));
+		}
+		struct entry* entry = &entries[count++];
+		entry->type = file->type;
+		entry->size = file->size;
+		entry->extents = extents ? std_file_extents(file) : 0;
+		entry->name = strdup(file->name);
+	} while (std_file_next(file, file));
+	struct entry* scratch = malloc(count * sizeof(struct entry));
+	struct entry* sorted = sort_entries(entries, scratch, count);
+
+	for (u64 i = 0; i < count; i++) {
+		struct entry* entry = &sorted[i];
+		if (entry->type == STD_DIRECTORY) {
+			printf("%7d  \033[94m%s\033[0m\n", entry->size, entry->name);
 		} else {
-			u64 size = file->size;
+			u64 size = entry->size;
 			char size_unit = 'B';
 			if (size >= 1024) {
 				size /= 1024;
@@ -46,9 +106,15 @@ int main(int argc, char** argv) {
 				size /= 1024;
 				size_unit = 'G';
 			}
-			printf("%7d%c %s\n", size, size_unit, file->name);
+			if (entry->extents > 1)
+				printf("%7d%c %s (%d extents)\n", size, size_unit, entry->name, entry->extents);
+			else
+				printf("%7d%c %s\n", size, size_unit, entry->name);
 		}
-	} while (std_file_next(file, file));
+		free(entry->name);
+	}
+	free(entries);
+	free(scratch);
 
 	std_file_close(file);
 	return 0;